@@ -10,6 +10,10 @@
 #include "esp_event.h"
 #include "esp_log.h"     
 #include "esp_system.h"    
+#include "esp_timer.h"
+#ifdef CONFIG_COMMAND_PROFILE
+#include "esp_cpu.h"
+#endif
 #include "esp_wifi.h"      
 
 #include "freertos/FreeRTOS.h" 
@@ -17,11 +21,100 @@
 #include "freertos/task.h"    
 
 #include "TCPServer.h"    
+#include "command.h"
+#include "msg_framer.h"
+#include "telemetry.h"
+#include "udp_telemetry.h"
 #include "user_uart.h"
+#include "ws_server.h"
 
-static int client_socks[3] = { -1,-1,-1 };
+typedef struct
+{
+    int sock;
+    char peer_addr[16];         // Dotted IPv4 address of the peer
+    uint16_t peer_port;
+    struct in_addr peer_in;
+    int64_t connected_at;       // esp_timer time of accept, in microseconds
+    TelemetryEncoding encoding; // Negotiated with a Hello message, JSON by default
+
+    // Subscription, set with a Subscribe message: full rate and all fields by default
+    // 订阅设置, 通过Subscribe消息设置, 默认全速率、全部字段
+    uint8_t fields;             // TelemetryField mask
+    uint32_t interval_us;       // Minimum spacing between samples, 0 for every sample
+    int64_t next_due;           // esp_timer time the next sample may be sent at
+    bool delta;                 // Send keyframes and changed fields only
+    TelemetryDelta_t delta_state;
+#ifdef CONFIG_TELEMETRY_UDP
+    struct sockaddr_in udp_dest; // Telemetry goes to this UDP port of the peer when sin_port is set
+    uint32_t udp_seq;
+#endif
+
+    bool closing;               // Connection failed or was dropped as a laggard
+
+    // Bytes the socket did not accept yet, kept in order so frames are never split
+    // 套接字尚未接收的字节, 按顺序保存, 保证帧不会被截断
+    uint8_t tx_buf[CONFIG_CLIENT_TX_BUFFER_SIZE];
+    size_t tx_head;
+    size_t tx_len;
+
+    bool tx_blocked;            // The socket refused data, wait until it is writable
+    bool batch;                 // Collect frames into segment-sized writes
+    int64_t batch_deadline;     // esp_timer time the oldest unsent frame has to go by
+
+    int64_t rx_at;              // esp_timer time of the last read from the socket
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    uint32_t frames_dropped;
+    size_t backlog_peak;
+
+    // Console commands of this client and the controller replies to them
+    // 该客户端的控制台命令及控制器对其的应答
+    uint32_t cmd_sent;
+    uint32_t cmd_ok;
+    uint32_t cmd_failed;        // Answered "0" by the controller
+    uint32_t cmd_timeouts;
+    uint64_t rtt_total_us;      // Round trips of answered commands
+    uint32_t rtt_max_us;
+
+    MsgFramer_t framer; // Command reassembly, only touched by the network task
+} Client_t;
+
+_Static_assert(CONFIG_CLIENT_TX_BUFFER_SIZE >= TELEMETRY_JSON_MAX_LEN, "CONFIG_CLIENT_TX_BUFFER_SIZE must hold one telemetry frame");
+_Static_assert(CONFIG_MAX_CLIENTS < CONFIG_LWIP_MAX_SOCKETS, "CONFIG_MAX_CLIENTS plus the listen socket exceed CONFIG_LWIP_MAX_SOCKETS");
+
+// Connection table, a slot is allocated on accept and freed on release so
+// unused capacity costs only a pointer
+// 连接表, 槽位在接受连接时分配, 释放时归还, 未使用的容量只占用一个指针
+static Client_t* clients[CONFIG_MAX_CLIENTS];
 static SemaphoreHandle_t client_mutex = NULL;
 
+// A command sent to the controller and not answered yet, protected by pending_mutex
+// so sending never waits for client_mutex
+// 已发往控制器且尚未应答的命令, 由pending_mutex保护, 发送命令无需等待client_mutex
+typedef struct
+{
+    int sock;           // Client the reply goes to, -1 for a free entry
+    uint8_t seq;        // Frame sequence number, the correlation ID on the UART link
+    bool has_id;
+    uint32_t id;        // "Id" of the Console message, echoed in the reply
+    int64_t sent_at;    // esp_timer time the command was handed to the UART
+    bool stale;         // Its sequence number came round again, no reply can match it
+} PendingCommand_t;
+
+// One entry more than CONFIG_COMMAND_MAX_PENDING, kept for an emergency stop
+// 比CONFIG_COMMAND_MAX_PENDING多一项, 预留给急停命令
+#define PENDING_SLOTS (CONFIG_COMMAND_MAX_PENDING + 1)
+
+static PendingCommand_t pending_commands[PENDING_SLOTS];
+static SemaphoreHandle_t pending_mutex = NULL;
+static uint32_t replies_unmatched = 0;
+
+#define COMMAND_REPLY_TIMEOUT_US (CONFIG_COMMAND_REPLY_TIMEOUT_MS * 1000LL)
+
+// Lowest Subscribe rate, one sample per 1000 s keeps the interval well inside 32 bits
+// 最低订阅速率, 每1000秒一个样本, 使间隔远在32位范围内
+#define SUBSCRIBE_MIN_RATE_HZ (0.001)
+
 static uint8_t s_retry_num = 0;
 static EventGroupHandle_t s_wifi_event_group; /* FreeRTOS event group to signal when connected*/
 #define WIFI_CONNECTED_BIT BIT0
@@ -32,6 +125,168 @@ static EventGroupHandle_t s_wifi_event_group; /* FreeRTOS event group to signal
 #define KEEPALIVE_INTERVAL 5
 #define KEEPALIVE_COUNT 3
 
+#define SERVER_SELECT_TIMEOUT_MS 50
+
+// One batch fills at most one TCP segment
+// 一个批次最多填满一个TCP分段
+#define BATCH_BUDGET (CONFIG_LWIP_TCP_MSS < CONFIG_CLIENT_TX_BUFFER_SIZE ? CONFIG_LWIP_TCP_MSS : CONFIG_CLIENT_TX_BUFFER_SIZE)
+#define BATCH_MAX_DELAY_US (CONFIG_TELEMETRY_BATCH_MAX_DELAY_MS * 1000)
+
+/**
+ * @brief Stop using a client connection, the network task closes it on its next pass
+ * @param c Client
+ * @retval None
+ * @note Called with client_mutex held
+ */
+static void client_abort(Client_t* c)
+{
+    if (c->closing)
+        return;
+    c->closing = true;
+    shutdown(c->sock, SHUT_RDWR);
+}
+
+/**
+ * @brief Push queued bytes to the socket without blocking
+ * @param c Client
+ * @retval None
+ * @note Called with client_mutex held
+ */
+static void client_flush(Client_t* c)
+{
+    while (c->tx_len > 0 && !c->closing)
+    {
+        size_t chunk = c->tx_len;
+        if (chunk > sizeof(c->tx_buf) - c->tx_head)
+            chunk = sizeof(c->tx_buf) - c->tx_head;
+        int sent = send(c->sock, c->tx_buf + c->tx_head, chunk, MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                ESP_LOGE("TCP_Server", "Error sending to client %d: errno %d", c->sock, errno);
+                client_abort(c);
+            }
+            c->tx_blocked = true;
+            return;
+        }
+        c->tx_head = (c->tx_head + sent) % sizeof(c->tx_buf);
+        c->tx_len -= sent;
+        c->bytes_sent += sent;
+        // Restart an empty queue at the front so the next batch is one contiguous send
+        // 队列清空后从头开始, 使下一个批次只需一次连续发送
+        if (c->tx_len == 0)
+            c->tx_head = 0;
+        if ((size_t)sent < chunk && c->tx_len > 0)
+        {
+            c->tx_blocked = true;
+            return;
+        }
+    }
+    c->tx_blocked = false;
+}
+
+/**
+ * @brief Append a complete frame to the send queue of a client
+ * @param c Client
+ * @param data Frame
+ * @param len Frame length
+ * @retval false if the frame did not fit and was dropped
+ * @note Called with client_mutex held. A frame that does not fit behind the
+ *       current backlog is dropped whole or the client is disconnected,
+ *       depending on CONFIG_CLIENT_LAGGARD_DISCONNECT
+ */
+static bool client_enqueue(Client_t* c, const uint8_t* data, size_t len)
+{
+    if (len > sizeof(c->tx_buf) - c->tx_len)
+    {
+        c->frames_dropped++;
+#ifdef CONFIG_CLIENT_LAGGARD_DISCONNECT
+        ESP_LOGW("TCP_Server", "Client %d backlog full, disconnecting", c->sock);
+        client_abort(c);
+#endif
+        return false;
+    }
+
+    size_t tail = (c->tx_head + c->tx_len) % sizeof(c->tx_buf);
+    size_t first = sizeof(c->tx_buf) - tail;
+    if (first > len)
+        first = len;
+    memcpy(c->tx_buf + tail, data, first);
+    memcpy(c->tx_buf, data + first, len - first);
+    c->tx_len += len;
+    if (c->tx_len > c->backlog_peak)
+        c->backlog_peak = c->tx_len;
+    return true;
+}
+
+/**
+ * @brief Whether the network task should push the queue of a client now
+ * @param c Client
+ * @param now esp_timer time
+ * @retval true if the socket refused data earlier or the batch is due
+ */
+static bool client_flush_due(const Client_t* c, int64_t now)
+{
+    return c->tx_len > 0 && (c->tx_blocked || !c->batch || now >= c->batch_deadline);
+}
+
+/**
+ * @brief Queue a complete frame for a client and send as much as possible without blocking
+ * @param c Client
+ * @param data Frame
+ * @param len Frame length
+ * @retval None
+ * @note Called with client_mutex held. In batch mode frames are only collected
+ *       until they fill BATCH_BUDGET or the oldest one waited
+ *       CONFIG_TELEMETRY_BATCH_MAX_DELAY_MS, the network task sends on the deadline.
+ */
+static void client_write(Client_t* c, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    if (c->closing)
+        return;
+
+    if (c->batch)
+    {
+        // Close the current batch rather than let this frame spill into a second segment
+        // 当前批次放不下此帧时先发送, 避免溢出到第二个分段
+        if (c->tx_len > 0 && c->tx_len + len > BATCH_BUDGET)
+            client_flush(c);
+        bool opens_batch = (c->tx_len == 0);
+        if (c->closing || !client_enqueue(c, p, len))
+            return;
+        if (opens_batch)
+            c->batch_deadline = esp_timer_get_time() + BATCH_MAX_DELAY_US;
+        if (c->tx_len >= BATCH_BUDGET || esp_timer_get_time() >= c->batch_deadline)
+            client_flush(c);
+        return;
+    }
+
+    client_flush(c);
+    if (c->tx_len == 0 && !c->closing)
+    {
+        int sent = send(c->sock, p, len, MSG_DONTWAIT);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            ESP_LOGE("TCP_Server", "Error sending to client %d: errno %d", c->sock, errno);
+            client_abort(c);
+        }
+        if (sent > 0)
+        {
+            c->bytes_sent += sent;
+            p += sent;
+            len -= sent;
+        }
+    }
+    if (len == 0 || c->closing)
+        return;
+    // Whatever remains is behind a full socket
+    // 剩余部分说明套接字已满
+    c->tx_blocked = true;
+    client_enqueue(c, p, len);
+}
+
 /**
  * @brief Handle WiFi events
  * @param arg User-defined argument
@@ -72,162 +327,1024 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
 }
 
 /**
- * @brief Parse command from a message string
- * @param msg Message string
- * @retval Parsed command
+ * @brief Handle a Hello message that selects the telemetry encoding of a client
+ * @param sock Client socket
+ * @param root Parsed message
+ * @retval None
  */
-Command parse_command(const char* msg)
+static void Process_Hello(int sock, const cJSON* root)
 {
-    Command cmd;
-    cmd.type = CMD_UNKNOWN;
-    memset(&cmd.params, 0, sizeof(cmd.params));
-
-    // Copy the input string to a temporary buffer because strtok modifies the string
-    // 复制传入的字符串到临时缓冲区，因为strtok会修改字符串
-    char* msg_copy = strdup(msg);
-    if (msg_copy == NULL)
-    {
-        return cmd;
-    }
-
-    // Split the string by spaces and get the first token as the command type
-    // 用空格拆分字符串，获取第一个token作为命令类型
-    char* token = strtok(msg_copy, " ");
-    if (token == NULL)
-    {
-        free(msg_copy);
-        return cmd;
-    }
-
-    if (strcmp(token, "move") == 0)
-    {
-        cmd.type = CMD_MOVE;
-        // 解析格式: move [Stop] [S/D] [WASD] [Value] [Time]
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.move.stop = atoi(token);
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.move.sd = token[0];
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            strncpy(cmd.params.move.wasd, token, sizeof(cmd.params.move.wasd) - 1);
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.move.value = atoi(token);
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.move.time = atoi(token);
-    }
-    else if (strcmp(token, "spin") == 0)
-    {
-        cmd.type = CMD_SPIN;
-        // 解析格式: spin [L/R] [Angle]
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.spin.lr = token[0];
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.spin.angle = atoi(token);
-    }
-    else if (strcmp(token, "motor") == 0)
-    {
-        cmd.type = CMD_MOTOR;
-        // 解析格式: motor [MotorID] [Dir] [Angle]
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.motor.motorID = atoi(token);
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.motor.dir = token[0];
-        token = strtok(NULL, " ");
-        if (token != NULL)
-            cmd.params.motor.angle = atoi(token);
+    TelemetryEncoding encoding = TELEMETRY_JSON;
+    const cJSON* enc_item = cJSON_GetObjectItem(root, "Encoding");
+    if (cJSON_IsString(enc_item) && strcmp(enc_item->valuestring, "binary") == 0)
+        encoding = TELEMETRY_BINARY;
+
+    // Acknowledge before switching so the client knows where binary frames start
+    // 切换前先应答, 使客户端知道二进制帧从何处开始
+    char ack[96];
+    int ack_len = snprintf(ack, sizeof(ack), "{\"type\":\"Hello\",\"Encoding\":\"%s\",\"Schema\":%d}",
+        encoding == TELEMETRY_BINARY ? "binary" : "json", TELEMETRY_BIN_SCHEMA);
+
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
+        if (clients[i] != NULL && clients[i]->sock == sock)
+        {
+            client_write(clients[i], ack, ack_len);
+            clients[i]->encoding = encoding;
+            break;
+        }
+    xSemaphoreGive(client_mutex);
+    ESP_LOGI("TCP_Server", "Client %d uses %s telemetry", sock, encoding == TELEMETRY_BINARY ? "binary" : "JSON");
+}
+
+/**
+ * @brief Handle a Subscribe message that sets the telemetry rate and fields of a client
+ * @param sock Client socket
+ * @param root Parsed message
+ * @retval None
+ * @note "Rate" is in Hz, absent or 0 means every sample, lower rates are raised
+ *       to SUBSCRIBE_MIN_RATE_HZ. "Fields" lists JSON keys
+ *       of the data object, absent or empty means all of them. Unknown keys are
+ *       ignored, the acknowledgement carries the settings actually applied.
+ *       "Delta": true selects delta mode, "Deadband" overrides the Kconfig
+ *       deadband of the fields it names. Every Subscribe restarts with a keyframe.
+ *       "UdpPort" moves the telemetry of this client to datagrams sent to that
+ *       port of its address, stamped and never in delta mode. "Batch" turns
+ *       segment batching on or off, absent means the CONFIG_TELEMETRY_BATCH default.
+ */
+static void Process_Subscribe(int sock, const cJSON* root)
+{
+    double rate = 0;
+    const cJSON* rate_item = cJSON_GetObjectItem(root, "Rate");
+    if (cJSON_IsNumber(rate_item) && rate_item->valuedouble > 0)
+        rate = rate_item->valuedouble < SUBSCRIBE_MIN_RATE_HZ ? SUBSCRIBE_MIN_RATE_HZ : rate_item->valuedouble;
+
+    uint8_t fields = 0;
+    const cJSON* fields_item = cJSON_GetObjectItem(root, "Fields");
+    const cJSON* field;
+    cJSON_ArrayForEach(field, fields_item)
+    {
+        uint8_t bit = cJSON_IsString(field) ? telemetry_field_from_name(field->valuestring) : 0;
+        if (bit == 0)
+            ESP_LOGW("TCP_Server", "Client %d subscribed to an unknown field", sock);
+        fields |= bit;
+    }
+    if (fields == 0)
+        fields = TELEMETRY_FIELDS_ALL;
+
+    bool delta = cJSON_IsTrue(cJSON_GetObjectItem(root, "Delta"));
+    TelemetryDelta_t delta_state;
+    telemetry_delta_init(&delta_state);
+    const cJSON* deadband;
+    cJSON_ArrayForEach(deadband, cJSON_GetObjectItem(root, "Deadband"))
+    {
+        uint8_t bit = telemetry_field_from_name(deadband->string);
+        if (bit == 0 || !cJSON_IsNumber(deadband) || deadband->valuedouble < 0)
+        {
+            ESP_LOGW("TCP_Server", "Client %d sent an invalid deadband", sock);
+            continue;
+        }
+        for (uint8_t i = 0;i < TELEMETRY_FIELD_COUNT;i++)
+            if (bit == (1 << i))
+                delta_state.deadband[i] = (float)deadband->valuedouble;
+    }
+
+#ifdef CONFIG_TELEMETRY_BATCH
+    bool batch = true;
+#else
+    bool batch = false;
+#endif
+    const cJSON* batch_item = cJSON_GetObjectItem(root, "Batch");
+    if (cJSON_IsBool(batch_item))
+        batch = cJSON_IsTrue(batch_item);
+
+    uint16_t udp_port = 0;
+#ifdef CONFIG_TELEMETRY_UDP
+    const cJSON* port_item = cJSON_GetObjectItem(root, "UdpPort");
+    if (cJSON_IsNumber(port_item) && port_item->valueint > 0 && port_item->valueint <= 65535)
+        udp_port = (uint16_t)port_item->valueint;
+    // Datagrams may be lost, a delta stream could not recover until the next keyframe
+    // 数据报可能丢失, 增量流在下一个关键帧之前无法恢复
+    if (udp_port)
+        delta = false;
+#endif
+
+    // Rates too high to honour collapse to every sample
+    // 过高的速率等同于逐个样本发送
+    uint32_t interval_us = (rate > 0 && rate < 1000000.0) ? (uint32_t)(1000000.0 / rate + 0.5) : 0;
+
+    char ack[224];
+    int ack_len = snprintf(ack, sizeof(ack), "{\"type\":\"Subscribe\",\"Rate\":%g,\"Fields\":[", rate);
+    bool first = true;
+    for (uint8_t i = 0;i < TELEMETRY_FIELD_COUNT;i++)
+        if (fields & (1 << i))
+        {
+            ack_len += snprintf(ack + ack_len, sizeof(ack) - ack_len, "%s\"%s\"", first ? "" : ",", telemetry_field_names[i]);
+            first = false;
+        }
+    ack_len += snprintf(ack + ack_len, sizeof(ack) - ack_len, "],\"Delta\":%s,\"Batch\":%s",
+        delta ? "true" : "false", batch ? "true" : "false");
+    if (udp_port)
+        ack_len += snprintf(ack + ack_len, sizeof(ack) - ack_len, ",\"UdpPort\":%u", udp_port);
+    ack_len += snprintf(ack + ack_len, sizeof(ack) - ack_len, "}");
+
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
+        if (clients[i] != NULL && clients[i]->sock == sock)
+        {
+            client_write(clients[i], ack, ack_len);
+            clients[i]->fields = fields;
+            clients[i]->interval_us = interval_us;
+            clients[i]->next_due = 0;
+            clients[i]->delta = delta;
+            clients[i]->delta_state = delta_state;
+            clients[i]->batch = batch;
+#ifdef CONFIG_TELEMETRY_UDP
+            memset(&clients[i]->udp_dest, 0, sizeof(clients[i]->udp_dest));
+            clients[i]->udp_dest.sin_family = AF_INET;
+            clients[i]->udp_dest.sin_addr = clients[i]->peer_in;
+            clients[i]->udp_dest.sin_port = htons(udp_port);
+            clients[i]->udp_seq = 0;
+#endif
+            break;
+        }
+    xSemaphoreGive(client_mutex);
+    ESP_LOGI("TCP_Server", "Client %d subscribed at %g Hz, field mask 0x%02x%s", sock, rate, fields, delta ? ", delta" : "");
+}
+
+/**
+ * @brief Find the client of a TCP socket
+ * @param sock Client socket
+ * @retval Client, NULL if the socket is not a TCP client
+ * @note Called with client_mutex held
+ */
+static Client_t* client_find(int sock)
+{
+    for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
+        if (clients[i] != NULL && clients[i]->sock == sock)
+            return clients[i];
+    return NULL;
+}
+
+// Stats reply, one format per section, every value a uint32_t
+// Stats应答, 每部分一个格式, 所有数值均为uint32_t
+#define STATS_FMT \
+    "{\"type\":\"Stats\",\"Uart\":{\"Frames\":%u,\"Lost\":%u,\"CrcErrors\":%u,\"HeaderErrors\":%u,\"Malformed\":%u,\"Overflows\":%u}" \
+    ",\"Queue\":{\"Overwritten\":%u,\"Skipped\":%u,\"Stalls\":%u},\"Replies\":{\"Unmatched\":%u}" \
+    ",\"EStop\":{\"Count\":%u,\"LastUs\":%u,\"MaxUs\":%u}" \
+    ",\"UartTx\":{\"Frames\":%u,\"Writes\":%u,\"Dropped\":%u,\"Depth\":%u,\"PeakDepth\":%u,\"WaitAvgUs\":%u,\"WaitMaxUs\":%u}"
+#define STATS_FMT_VALUES (20)
+#define STATS_FMT_UDP ",\"Udp\":{\"Sent\":%u,\"Dropped\":%u}"
+#define STATS_FMT_UDP_VALUES (2)
+#define STATS_FMT_WS ",\"WebSocket\":{\"Dropped\":%u}"
+#define STATS_FMT_WS_VALUES (1)
+#define STATS_FMT_CLIENT \
+    ",\"Client\":{\"BytesSent\":%u,\"Dropped\":%u" \
+    ",\"Commands\":{\"Sent\":%u,\"Ok\":%u,\"Failed\":%u,\"Timeouts\":%u,\"RttAvgUs\":%u,\"RttMaxUs\":%u}}}"
+#define STATS_FMT_CLIENT_VALUES (8)
+// Worst case: every section, and each %u grown to the 10 digits of UINT32_MAX
+// 最坏情况: 包含所有部分, 每个%u扩展为UINT32_MAX的10位数字
+#define STATS_ACK_SIZE (sizeof(STATS_FMT STATS_FMT_UDP STATS_FMT_WS STATS_FMT_CLIENT) \
+    + (STATS_FMT_VALUES + STATS_FMT_UDP_VALUES + STATS_FMT_WS_VALUES + STATS_FMT_CLIENT_VALUES) * (10 - 2))
+
+/**
+ * @brief Check that a Stats reply still fits its buffer
+ * @param sock Client socket
+ * @param len Reply length so far, as summed from snprintf
+ * @param size Size of the buffer
+ * @retval true if it does not, the reply is then not sent and this is logged
+ */
+static bool stats_overflow(int sock, int len, size_t size)
+{
+    if (len >= 0 && (size_t)len < size)
+        return false;
+    ESP_LOGE("TCP_Server", "Client %d: Stats reply longer than %u bytes, not sent", sock, (unsigned)size);
+    return true;
+}
+
+/**
+ * @brief Handle a Stats message, replies with the loss counters of every stage
+ * @param sock Client socket
+ * @retval None
+ * @note Uart counts frames lost on the line or rejected, Queue samples the ring
+ *       dropped before Process_Data took them, Client the frames this client lost
+ *       to its own backlog and the outcome and round trip of its commands.
+ *       Replies counts controller replies that matched no pending command,
+ *       EStop the emergency stops and their time from receipt to the UART
+ *       driver write, UartTx the depth of the TX queue and how long frames wait in it.
+ *       Udp and WebSocket are totals of those transports.
+ */
+static void Process_Stats(int sock)
+{
+    UartRxStats_t uart;
+    UartTxStats_t uart_tx;
+    SampleRingStats_t ring;
+    uart_rx_stats(&uart);
+    uart_tx_stats(&uart_tx);
+    uart_sample_stats(&ring);
+
+    char ack[STATS_ACK_SIZE];
+    int ack_len = snprintf(ack, sizeof(ack), STATS_FMT,
+        (unsigned)uart.frames.frames_ok, (unsigned)uart.frames.seq_gaps, (unsigned)uart.frames.crc_errors,
+        (unsigned)uart.frames.header_errors, (unsigned)uart.malformed, (unsigned)uart.overflows,
+        (unsigned)ring.overwritten, (unsigned)ring.skipped, (unsigned)ring.stalls, (unsigned)replies_unmatched,
+        (unsigned)uart_tx.estop_count, (unsigned)uart_tx.estop_last_us, (unsigned)uart_tx.estop_max_us,
+        (unsigned)uart_tx.frames, (unsigned)uart_tx.writes, (unsigned)uart_tx.dropped, (unsigned)uart_tx.depth,
+        (unsigned)uart_tx.depth_peak, (unsigned)uart_tx.wait_avg_us, (unsigned)uart_tx.wait_max_us);
+    if (stats_overflow(sock, ack_len, sizeof(ack)))
+        return;
+#ifdef CONFIG_TELEMETRY_UDP
+    UdpTelemetryStats_t udp;
+    udp_telemetry_stats(&udp);
+    ack_len += snprintf(ack + ack_len, sizeof(ack) - ack_len, STATS_FMT_UDP, (unsigned)udp.sent, (unsigned)udp.dropped);
+    if (stats_overflow(sock, ack_len, sizeof(ack)))
+        return;
+#endif
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+    ack_len += snprintf(ack + ack_len, sizeof(ack) - ack_len, STATS_FMT_WS, (unsigned)ws_server_frames_dropped());
+    if (stats_overflow(sock, ack_len, sizeof(ack)))
+        return;
+#endif
+
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    Client_t* c = client_find(sock);
+    if (c != NULL)
+    {
+        uint32_t answered = c->cmd_ok + c->cmd_failed;
+        int len = ack_len + snprintf(ack + ack_len, sizeof(ack) - ack_len, STATS_FMT_CLIENT,
+            (unsigned)c->bytes_sent, (unsigned)c->frames_dropped,
+            (unsigned)c->cmd_sent, (unsigned)c->cmd_ok, (unsigned)c->cmd_failed, (unsigned)c->cmd_timeouts,
+            (unsigned)(answered ? c->rtt_total_us / answered : 0), (unsigned)c->rtt_max_us);
+        if (!stats_overflow(sock, len, sizeof(ack)))
+            client_write(c, ack, len);
     }
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+    // A WebSocket client has no per-client counters
+    // WebSocket客户端没有单独的计数
     else
     {
-        cmd.type = CMD_UNKNOWN;
+        int len = ack_len + snprintf(ack + ack_len, sizeof(ack) - ack_len, "}");
+        if (!stats_overflow(sock, len, sizeof(ack)))
+            ws_server_send(sock, ack, len);
     }
+#endif
+    xSemaphoreGive(client_mutex);
+}
 
-    free(msg_copy);
-    return cmd;
+#ifdef CONFIG_COMMAND_PROFILE
+/**
+ * @brief Account the time of one command parse
+ * @param cycles CPU cycles the parse took
+ * @retval None
+ * @note Logs the average and worst parse time every 100 commands
+ */
+static void command_profile(uint32_t cycles)
+{
+    static uint64_t total = 0;
+    static uint32_t worst = 0, count = 0;
+
+    total += cycles;
+    if (cycles > worst)
+        worst = cycles;
+    if (++count == 100)
+    {
+        const uint32_t mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+        ESP_LOGI("TCP_Server", "Command parse: %u ns average, %u ns worst",
+            (unsigned)(total * 1000 / count / mhz), (unsigned)((uint64_t)worst * 1000 / mhz));
+        total = worst = count = 0;
+    }
 }
+#endif
 
 /**
- * @brief Process client data received in JSON format
- * @param json_input JSON input string
+ * @brief Send the outcome of a command to the client that issued it
+ * @param cmd Command, only sock, has_id, id and seq are used
+ * @param ok Whether the command succeeded
+ * @param error Why it failed without a controller reply, NULL for a reply
+ * @param rtt_us Round trip of a reply
  * @retval None
+ * @note Called with client_mutex held. The client may be a TCP or a WebSocket client.
  */
-void Process_Client_Data(const char* json_input)
+static void command_reply(const PendingCommand_t* cmd, bool ok, const char* error, int64_t rtt_us)
 {
-    cJSON* root = cJSON_Parse(json_input);
-    if (root == NULL)
+    char reply[160];
+    int len = snprintf(reply, sizeof(reply), "{\"type\":\"Console\",\"Dir\":\"ReceivedFromController\",\"Msg\":\"%d\"", ok);
+    if (cmd->has_id)
+        len += snprintf(reply + len, sizeof(reply) - len, ",\"Id\":%u", (unsigned)cmd->id);
+    if (error != NULL)
+        len += snprintf(reply + len, sizeof(reply) - len, ",\"Error\":\"%s\"}", error);
+    else
+        len += snprintf(reply + len, sizeof(reply) - len, ",\"Seq\":%u,\"RttUs\":%u}", cmd->seq, (unsigned)rtt_us);
+    if (len >= (int)sizeof(reply))
+        return;
+
+    Client_t* c = client_find(cmd->sock);
+    if (c != NULL)
+        client_write(c, reply, len);
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+    else
+        ws_server_send(cmd->sock, reply, len);
+#endif
+}
+
+/**
+ * @brief Register a command about to be sent so its reply can be routed back
+ * @param origin Client socket and Id of the command
+ * @param urgent Emergency stop, may take the entry kept in reserve for it
+ * @param seq Sequence number to send the command with
+ * @retval false if too many commands are pending
+ */
+static bool command_register(const PendingCommand_t* origin, bool urgent, uint8_t* seq)
+{
+    PendingCommand_t* cmd = NULL;
+    uint8_t used = 0;
+    xSemaphoreTake(pending_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
     {
-        ESP_LOGE("TCP_Server", "Invalid JSON input");
+        if (pending_commands[i].sock >= 0)
+            used++;
+        else if (cmd == NULL)
+            cmd = &pending_commands[i];
+    }
+    if (cmd == NULL || (!urgent && used >= CONFIG_COMMAND_MAX_PENDING))
+    {
+        xSemaphoreGive(pending_mutex);
+        return false;
+    }
+
+    *cmd = *origin;
+    cmd->seq = *seq = uart_tx_seq();
+    cmd->stale = false;
+    cmd->sent_at = esp_timer_get_time();
+    // After 256 frames the sequence number comes round again, an older command
+    // still holding it can no longer be told apart and counts as timed out
+    // 序号每256帧循环一次, 仍占用该序号的旧命令已无法区分, 按超时处理
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
+    {
+        PendingCommand_t* old = &pending_commands[i];
+        if (old != cmd && old->sock >= 0 && old->seq == cmd->seq)
+            old->stale = true;
+    }
+    xSemaphoreGive(pending_mutex);
+    return true;
+}
+
+/**
+ * @brief Drop the entry of a command that could not be sent after all
+ * @param seq Sequence number it was registered with
+ * @retval None
+ */
+static void command_cancel(uint8_t seq)
+{
+    xSemaphoreTake(pending_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
+        if (pending_commands[i].sock >= 0 && !pending_commands[i].stale && pending_commands[i].seq == seq)
+            pending_commands[i].sock = -1;
+    xSemaphoreGive(pending_mutex);
+}
+
+/**
+ * @brief Pack, register and send a command to the controller
+ * @param origin Client socket and Id of the command
+ * @param cmd Validated command
+ * @param urgent Emergency stop: never refused, sent untracked if no entry is left
+ * @param rx_at esp_timer time the command was read from its socket
+ * @retval true if the command was sent with a reply expected
+ * @note Takes client_mutex only to refuse a command, never on the way to the UART.
+ *       Only queues the frame, the UART TX task writes it.
+ */
+static bool command_send(const PendingCommand_t* origin, const Command* cmd, bool urgent, int64_t rx_at)
+{
+    // Only the arguments of this command go on the wire, framed and CRC protected
+    // 只发送该命令的参数, 并加上帧头与CRC保护
+    uint8_t payload[COMMAND_PAYLOAD_MAX_LEN];
+    size_t len = command_pack(cmd, payload, sizeof(payload));
+    if (len == 0)
+        return false;
+
+    // Registered before it is sent, so even an immediate reply finds its client
+    // 发送前先登记, 即使应答立即到达也能找到对应客户端
+    uint8_t seq;
+    bool tracked = command_register(origin, urgent, &seq);
+    if (!tracked && !urgent)
+    {
+        ESP_LOGW("TCP_Server", "Client %d: %d commands awaiting a reply, refusing command", origin->sock, CONFIG_COMMAND_MAX_PENDING);
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        command_reply(origin, false, "busy", 0);
+        xSemaphoreGive(client_mutex);
+        return false;
+    }
+    if (!tracked)
+        seq = uart_tx_seq();
+    // Queued for the UART TX task, an emergency stop at the front
+    // 交给UART发送任务排队, 急停命令排在队首
+    if (!uart_send_frame(UART_FRAME_COMMAND, seq, payload, (uint8_t)len, urgent, rx_at))
+    {
+        ESP_LOGW("TCP_Server", "Client %d: UART TX queue full, refusing command", origin->sock);
+        command_cancel(seq);
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        command_reply(origin, false, "busy", 0);
+        xSemaphoreGive(client_mutex);
+        return false;
+    }
+    if (!tracked)
+        ESP_LOGW("TCP_Server", "Client %d: emergency stop sent untracked, every reply entry in use", origin->sock);
+    return tracked;
+}
+
+/**
+ * @brief Count a command sent for a client
+ * @param sock Client socket
+ * @retval None
+ */
+static void command_count_sent(int sock)
+{
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    Client_t* c = client_find(sock);
+    if (c != NULL)
+        c->cmd_sent++;
+    xSemaphoreGive(client_mutex);
+}
+
+/**
+ * @brief Report every command whose reply is overdue as timed out
+ * @param now esp_timer time
+ * @retval None
+ * @note Called by the network task on every pass, so a timeout is reported
+ *       at most SERVER_SELECT_TIMEOUT_MS late
+ */
+static void command_expire(int64_t now)
+{
+    PendingCommand_t expired[PENDING_SLOTS];
+    uint8_t count = 0;
+    xSemaphoreTake(pending_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
+    {
+        PendingCommand_t* cmd = &pending_commands[i];
+        if (cmd->sock < 0 || (!cmd->stale && now - cmd->sent_at < COMMAND_REPLY_TIMEOUT_US))
+            continue;
+        expired[count++] = *cmd;
+        cmd->sock = -1;
+    }
+    xSemaphoreGive(pending_mutex);
+    if (count == 0)
+        return;
+
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < count;i++)
+    {
+        Client_t* c = client_find(expired[i].sock);
+        if (c != NULL)
+            c->cmd_timeouts++;
+        ESP_LOGW("TCP_Server", "Client %d: no controller reply to command seq %u", expired[i].sock, expired[i].seq);
+        command_reply(&expired[i], false, "timeout", 0);
+    }
+    xSemaphoreGive(client_mutex);
+}
+
+/**
+ * @brief Drop the pending commands of a client that is going away
+ * @param sock Client socket
+ * @retval None
+ * @note A reply arriving later is then not delivered to a new connection that
+ *       reuses the socket number
+ */
+static void command_forget(int sock)
+{
+    xSemaphoreTake(pending_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
+        if (pending_commands[i].sock == sock)
+            pending_commands[i].sock = -1;
+    xSemaphoreGive(pending_mutex);
+}
+
+/**
+ * @brief Drop the pending commands of a WebSocket client that is going away
+ * @param sock Client socket
+ * @retval None
+ */
+void Forget_Client_Commands(int sock)
+{
+    if (pending_mutex != NULL)
+        command_forget(sock);
+}
+
+/**
+ * @brief Route a controller reply to the client whose command it answers
+ * @param seq Sequence number of the command frame answered
+ * @param ok Result reported by the controller
+ * @retval None
+ * @note Called from the UART receive task. A reply to a command that timed out,
+ *       or whose client left, is counted and dropped.
+ */
+void Process_Controller_Reply(uint8_t seq, bool ok)
+{
+    if (client_mutex == NULL)
+        return;
+    int64_t now = esp_timer_get_time();
+    PendingCommand_t cmd = { .sock = -1 };
+    xSemaphoreTake(pending_mutex, portMAX_DELAY);
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
+        if (pending_commands[i].sock >= 0 && !pending_commands[i].stale && pending_commands[i].seq == seq)
+        {
+            cmd = pending_commands[i];
+            pending_commands[i].sock = -1;
+            break;
+        }
+    if (cmd.sock < 0)
+        replies_unmatched++;
+    xSemaphoreGive(pending_mutex);
+    if (cmd.sock < 0)
+    {
+        ESP_LOGW("TCP_Server", "Controller reply to unknown command seq %u", seq);
+        return;
+    }
+
+    int64_t rtt_us = now - cmd.sent_at;
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    Client_t* c = client_find(cmd.sock);
+    if (c != NULL)
+    {
+        if (ok)
+            c->cmd_ok++;
+        else
+            c->cmd_failed++;
+        c->rtt_total_us += rtt_us;
+        if (rtt_us > c->rtt_max_us)
+            c->rtt_max_us = (uint32_t)rtt_us;
+    }
+    command_reply(&cmd, ok, NULL, rtt_us);
+    xSemaphoreGive(client_mutex);
+}
+
+/**
+ * @brief Find the value of an object member in a raw JSON message
+ * @param json Message
+ * @param len Message length
+ * @param key Member name, quotes included
+ * @retval First character of the value, NULL if the member is not found
+ * @note A plain byte search, good enough to spot a member ahead of the parser:
+ *       a match inside a string value is skipped only when its quote is escaped
+ */
+static const char* json_raw_member(const char* json, size_t len, const char* key)
+{
+    size_t key_len = strlen(key);
+    const char* end = json + len;
+    for (const char* p = json;p + key_len < end;p++)
+    {
+        if (*p != '"' || memcmp(p, key, key_len) != 0 || (p > json && p[-1] == '\\'))
+            continue;
+        const char* v = p + key_len;
+        while (v < end && (*v == ' ' || *v == '\t'))
+            v++;
+        if (v == end || *v != ':')
+            continue;
+        v++;
+        while (v < end && (*v == ' ' || *v == '\t'))
+            v++;
+        return (v < end) ? v : NULL;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Send an emergency stop straight away, ahead of JSON parsing
+ * @param sock Client socket
+ * @param json Raw message, not necessarily NUL terminated
+ * @param len Message length
+ * @param rx_at esp_timer time the message was read from its socket
+ * @retval true if the message was an emergency stop and has been handled
+ * @note A Console message with a "move 1 ..." Msg is recognised on the raw bytes
+ *       and sent without cJSON and without client_mutex, which the telemetry
+ *       broadcast may hold. Only "type", "Msg" and "Id" are looked at: the rest
+ *       of the message is not validated, so a stop in an otherwise malformed
+ *       message is still executed, and the message then never reaches the
+ *       normal path, which would report it invalid. Within Msg only the stop
+ *       argument counts, the canonical stop is sent whatever the remaining
+ *       arguments are.
+ *       Anything else, including a Msg with escape sequences, returns false and
+ *       takes the normal path. The UART TX task logs and keeps for Stats the
+ *       time from rx_at to the driver write of the stop.
+ */
+bool Process_EStop(int sock, const char* json, size_t len, int64_t rx_at)
+{
+    const char* end = json + len;
+    const char* type = json_raw_member(json, len, "\"type\"");
+    if (type == NULL || end - type < 9 || memcmp(type, "\"Console\"", 9) != 0)
+        return false;
+    const char* msg = json_raw_member(json, len, "\"Msg\"");
+    if (msg == NULL || *msg != '"' || end - msg < 6 || memcmp(msg + 1, "move", 4) != 0)
+        return false;
+    msg++;
+    const char* msg_end = memchr(msg, '"', end - msg);
+    if (msg_end == NULL || memchr(msg, '\\', msg_end - msg) != NULL)
+        return false;
+
+    Command cmd;
+    if (!command_parse_estop(msg, msg_end - msg, &cmd))
+        return false;
+
+    PendingCommand_t origin = { .sock = sock };
+    const char* id = json_raw_member(json, len, "\"Id\"");
+    if (id != NULL && *id >= '0' && *id <= '9')
+    {
+        uint64_t value = 0;
+        while (id < end && *id >= '0' && *id <= '9' && value <= UINT32_MAX)
+            value = value * 10 + (*id++ - '0');
+        origin.has_id = (value <= UINT32_MAX);
+        origin.id = (uint32_t)value;
+    }
+
+    if (command_send(&origin, &cmd, true, rx_at))
+        command_count_sent(sock);
+    return true;
+}
+
+/**
+ * @brief Act on one binary command message
+ * @param sock Client socket
+ * @param msg Message, | MSG_BIN_MAGIC | Len | Id (u32 LE) | command frame payload |
+ * @param len Message length
+ * @param rx_at esp_timer time the message was read from its socket
+ * @retval None
+ * @note Neither cJSON nor parse_command is involved: the payload is already in
+ *       the command frame layout and only checked against the command schema.
+ *       The reply is the same JSON Console reply as for a text command.
+ */
+void Process_Client_Binary(int sock, const uint8_t* msg, size_t len, int64_t rx_at)
+{
+    if (len < MSG_BIN_HEADER_LEN || msg[0] != MSG_BIN_MAGIC || len != MSG_BIN_HEADER_LEN + (size_t)msg[1])
+    {
+        ESP_LOGE("TCP_Server", "Client %d: malformed binary command", sock);
+        return;
+    }
+    PendingCommand_t origin = {
+        .sock = sock,
+        .has_id = true,
+        .id = (uint32_t)msg[2] | (uint32_t)msg[3] << 8 | (uint32_t)msg[4] << 16 | (uint32_t)msg[5] << 24,
+    };
+
+    Command cmd;
+#ifdef CONFIG_COMMAND_PROFILE
+    uint32_t t0 = esp_cpu_get_cycle_count();
+    CommandStatus status = command_unpack(msg + MSG_BIN_HEADER_LEN, msg[1], &cmd);
+    command_profile(esp_cpu_get_cycle_count() - t0);
+#else
+    CommandStatus status = command_unpack(msg + MSG_BIN_HEADER_LEN, msg[1], &cmd);
+#endif
+    if (status != CMD_OK && command_unpack_estop(msg + MSG_BIN_HEADER_LEN, msg[1], &cmd))
+        status = CMD_OK;
+    if (status != CMD_OK)
+    {
+        ESP_LOGW("TCP_Server", "Client %d: rejected binary command: %s", sock, command_status_str(status));
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        command_reply(&origin, false, command_status_str(status), 0);
+        xSemaphoreGive(client_mutex);
+        return;
+    }
+
+    bool urgent = (cmd.type == CMD_MOVE && cmd.params.move.stop == 1);
+    if (command_send(&origin, &cmd, urgent, rx_at))
+        command_count_sent(sock);
+}
+
+/**
+ * @brief Act on one parsed client message
+ * @param sock TCP client socket the message came from, acknowledgements are sent there
+ * @param root Parsed message
+ * @param rx_at esp_timer time the message was read from its socket
+ * @retval None
+ * @note Shared by the TCP and WebSocket transports
+ */
+void Process_Client_Message(int sock, const cJSON* root, int64_t rx_at)
+{
+    const cJSON* type_item = cJSON_GetObjectItem(root, "type");
+    if (cJSON_IsString(type_item) && strcmp(type_item->valuestring, "Hello") == 0)
+    {
+        Process_Hello(sock, root);
+        return;
+    }
+    if (cJSON_IsString(type_item) && strcmp(type_item->valuestring, "Subscribe") == 0)
+    {
+        Process_Subscribe(sock, root);
+        return;
+    }
+    if (cJSON_IsString(type_item) && strcmp(type_item->valuestring, "Stats") == 0)
+    {
+        Process_Stats(sock);
         return;
     }
 
     // Get the "Msg" field
     // 获取 "Msg" 字段
-    cJSON* msg_item = cJSON_GetObjectItem(root, "Msg");
-    if (msg_item == NULL || msg_item->valuestring == NULL)
+    const cJSON* msg_item = cJSON_GetObjectItem(root, "Msg");
+    if (!cJSON_IsString(msg_item) || msg_item->valuestring == NULL)
     {
         ESP_LOGE("TCP_Server", "No Msg field found");
-        cJSON_Delete(root);
         return;
     }
 
-    // Call parse_command to parse the command string
-    // 调用parse_command解析指令字符串
-    Command cmd = parse_command(msg_item->valuestring);
-    if (cmd.type != CMD_UNKNOWN) uart_send((const char*)&cmd, sizeof(cmd));
+    // Optional Id the client correlates the reply with
+    // 可选的Id, 客户端据此匹配应答
+    PendingCommand_t origin = { .sock = sock };
+    const cJSON* id_item = cJSON_GetObjectItem(root, "Id");
+    if (cJSON_IsNumber(id_item) && id_item->valuedouble >= 0 && id_item->valuedouble <= UINT32_MAX)
+    {
+        origin.has_id = true;
+        origin.id = (uint32_t)id_item->valuedouble;
+    }
+
+    // Call parse_command to parse the command string, in place and without allocating
+    // 调用parse_command原地解析指令字符串, 不分配内存
+    Command cmd;
+    const char* msg = msg_item->valuestring;
+#ifdef CONFIG_COMMAND_PROFILE
+    uint32_t t0 = esp_cpu_get_cycle_count();
+    CommandStatus status = parse_command(msg, strlen(msg), &cmd);
+    command_profile(esp_cpu_get_cycle_count() - t0);
+#else
+    CommandStatus status = parse_command(msg, strlen(msg), &cmd);
+#endif
+    // An emergency stop is sent even if its other arguments do not parse
+    // 急停命令即使其余参数无法解析也照样发送
+    if (status != CMD_OK && command_parse_estop(msg, strlen(msg), &cmd))
+        status = CMD_OK;
+    if (status != CMD_OK)
+    {
+        ESP_LOGW("TCP_Server", "Client %d: rejected command \"%s\": %s", sock, msg, command_status_str(status));
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        command_reply(&origin, false, command_status_str(status), 0);
+        xSemaphoreGive(client_mutex);
+        return;
+    }
+
+    // An emergency stop the raw scan missed still gets its reserved entry
+    // 原始扫描未识别的急停命令仍可使用预留的登记项
+    bool urgent = (cmd.type == CMD_MOVE && cmd.params.move.stop == 1);
+    if (command_send(&origin, &cmd, urgent, rx_at))
+        command_count_sent(sock);
+}
 
+/**
+ * @brief Process one client message received in JSON format
+ * @param sock Client socket the data came from
+ * @param json_input JSON message, not necessarily NUL terminated
+ * @param len Message length
+ * @param rx_at esp_timer time the message was read from its socket
+ * @retval None
+ */
+void Process_Client_Data(int sock, const char* json_input, size_t len, int64_t rx_at)
+{
+    cJSON* root = cJSON_ParseWithLength(json_input, len);
+    if (root == NULL)
+    {
+        ESP_LOGE("TCP_Server", "Invalid JSON input");
+        return;
+    }
+    Process_Client_Message(sock, root, rx_at);
     cJSON_Delete(root);
 }
 
 /**
- * @brief Task to handle client connections
- * @param pvParameters Task parameters
+ * @brief Framer callback for one complete client message
+ * @param msg Message bytes
+ * @param len Message length
+ * @param ctx Client
  * @retval None
+ * @note Binary commands are told from JSON by their first byte. An emergency
+ *       stop is sent before anything is parsed.
  */
-void handle_client_task(void* pvParameters)
+static void client_message_handler(const char* msg, size_t len, void* ctx)
 {
-    int sock = (int)pvParameters;
-    int len;
-    char rx_buffer[256];
+    Client_t* c = ctx;
+    if ((uint8_t)msg[0] == MSG_BIN_MAGIC)
+        Process_Client_Binary(c->sock, (const uint8_t*)msg, len, c->rx_at);
+    else if (!Process_EStop(c->sock, msg, len, c->rx_at))
+        Process_Client_Data(c->sock, msg, len, c->rx_at);
+}
+
+/**
+ * @brief Accept every pending connection on the listen socket
+ * @param listen_sock Non-blocking listen socket
+ * @retval false if the listen socket failed and the server has to stop
+ */
+static bool server_accept(int listen_sock)
+{
+    int keepAlive = 1;
+    int keepIdle = KEEPALIVE_IDLE;
+    int keepInterval = KEEPALIVE_INTERVAL;
+    int keepCount = KEEPALIVE_COUNT;
+    int noDelay = 1;
 
     while (1)
     {
-        len = recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-        if (len < 0)
+        struct sockaddr_in source_addr;
+        socklen_t addr_len = sizeof(source_addr);
+
+        int sock = accept(listen_sock, (struct sockaddr*)&source_addr, &addr_len);
+        if (sock < 0)
         {
-            ESP_LOGE("TCP_Server", "recv error: errno %d", errno);
-            break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                return true;
+            ESP_LOGE("TCP_Server", "Unable to accept connection: errno %d", errno);
+            return false;
         }
-        else if (len == 0)
+
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+        // Frames are coalesced by the batching below or sent on their own on purpose, Nagle would only add delay
+        // 帧由下方的批处理合并或有意单独发送, Nagle算法只会增加延迟
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+        // Only this task fills slots, so a free one found here stays free until it is published
+        // 只有本任务会占用槽位, 因此此处找到的空槽位在发布前不会被占用
+        int slot = -1;
+        for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
+            if (clients[i] == NULL)
+            {
+                slot = i;
+                break;
+            }
+        Client_t* c = (slot >= 0) ? calloc(1, sizeof(Client_t)) : NULL;
+        if (c == NULL)
         {
-            ESP_LOGW("TCP_Server", "Connection closed");
+            ESP_LOGW("TCP_Server", "%s, dropping new client", (slot < 0) ? "Client list full" : "No memory for client");
+            shutdown(sock, 0);
+            close(sock);
+            continue;
+        }
+        c->sock = sock;
+        inet_ntoa_r(source_addr.sin_addr, c->peer_addr, sizeof(c->peer_addr));
+        c->peer_port = ntohs(source_addr.sin_port);
+        c->peer_in = source_addr.sin_addr;
+        c->connected_at = esp_timer_get_time();
+        c->encoding = TELEMETRY_JSON;
+        c->fields = TELEMETRY_FIELDS_ALL;
+#ifdef CONFIG_TELEMETRY_BATCH
+        c->batch = true;
+#endif
+        msg_framer_init(&c->framer);
+
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        clients[slot] = c;
+        xSemaphoreGive(client_mutex);
+        ESP_LOGI("TCP_Server", "Socket accepted, IP address: %s:%u, slot %d", c->peer_addr, c->peer_port, slot);
+    }
+}
+
+/**
+ * @brief Read whatever a readable client has sent and dispatch complete messages
+ * @param c Client
+ * @retval None
+ * @note Runs in the network task without client_mutex, the framer is only used there
+ */
+static void client_receive(Client_t* c)
+{
+    size_t space;
+    char* rx = msg_framer_buffer(&c->framer, &space);
+    int len = recv(c->sock, rx, space, 0);
+    if (len < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        ESP_LOGE("TCP_Server", "recv error: errno %d", errno);
+    }
+    else if (len == 0)
+    {
+        ESP_LOGW("TCP_Server", "Connection closed");
+    }
+    else
+    {
+        // Dispatch every message completed by this read in one pass
+        // 一次性分发本次读取所补全的全部消息
+        c->rx_at = esp_timer_get_time();
+        c->bytes_received += len;
+        unsigned count = msg_framer_commit(&c->framer, len, client_message_handler, c);
+        ESP_LOGD("TCP_Server", "Received %d bytes, %u messages from client %d", len, count, c->sock);
+        return;
+    }
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    client_abort(c);
+    xSemaphoreGive(client_mutex);
+}
+
+/**
+ * @brief Release a client slot once its connection is done
+ * @param slot Connection table slot
+ * @retval None
+ * @note Called with client_mutex held, only from the network task
+ */
+static void client_release(Client_t** slot)
+{
+    Client_t* c = *slot;
+    ESP_LOGI("TCP_Server", "Client %s:%u: connected %llu s, %u bytes sent, %u bytes received, %u frames dropped, peak backlog %u bytes",
+        c->peer_addr, c->peer_port, (unsigned long long)((esp_timer_get_time() - c->connected_at) / 1000000),
+        (unsigned)c->bytes_sent, (unsigned)c->bytes_received, (unsigned)c->frames_dropped, (unsigned)c->backlog_peak);
+    command_forget(c->sock);
+    close(c->sock);
+    free(c);
+    *slot = NULL;
+    ESP_LOGI("TCP_Server", "Client disconnected");
+}
+
+/**
+ * @brief Network task, drives the listen socket and every client socket with select()
+ * @param pvParameters Listen socket
+ * @retval None
+ * @note Accepting, receiving, command dispatch and draining the send queues all
+ *       happen here, so there is no task per client. Process_Data only appends
+ *       to the send queues.
+ */
+static void tcp_server_task(void* pvParameters)
+{
+    int listen_sock = (int)pvParameters;
+
+    ESP_LOGI("TCP_Server", "Waiting for client connections...");
+    while (1)
+    {
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        FD_SET(listen_sock, &read_set);
+        int max_fd = listen_sock;
+
+        // Release finished clients and build the interest sets in one pass
+        // 一次遍历中释放已结束的客户端并构建监听集合
+        // The timeout bounds how long a client Process_Data marked as closing waits for
+        // the next pass, and is shortened to the earliest pending batch deadline
+        // 超时时间限定了被Process_Data标记关闭的客户端等待下一轮处理的时长, 并缩短到最早的批次截止时间
+        int64_t now = esp_timer_get_time();
+        int64_t wait_us = SERVER_SELECT_TIMEOUT_MS * 1000;
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
+        {
+            Client_t* c = clients[i];
+            if (c == NULL)
+                continue;
+            if (c->closing)
+            {
+                client_release(&clients[i]);
+                continue;
+            }
+            FD_SET(c->sock, &read_set);
+            if (client_flush_due(c, now))
+                FD_SET(c->sock, &write_set);
+            else if (c->tx_len > 0 && c->batch_deadline - now < wait_us)
+                wait_us = c->batch_deadline - now;
+            if (c->sock > max_fd)
+                max_fd = c->sock;
+        }
+        xSemaphoreGive(client_mutex);
+
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = (long)wait_us,
+        };
+        int ready = select(max_fd + 1, &read_set, &write_set, NULL, &timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ESP_LOGE("TCP_Server", "select error: errno %d", errno);
             break;
         }
-        else
+        command_expire(esp_timer_get_time());
+        if (ready == 0)
+            continue;
+
+        if (FD_ISSET(listen_sock, &read_set) && !server_accept(listen_sock))
+            break;
+
+        // Only this task adds or removes clients, so the table can be read without the mutex
+        // 只有本任务会增删客户端, 因此读取连接表无需加锁
+        for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
         {
-            rx_buffer[len] = 0;
-            ESP_LOGI("TCP_Server", "Received %d bytes from client: %s", len, rx_buffer);
-            Process_Client_Data(rx_buffer);
+            Client_t* c = clients[i];
+            if (c == NULL || (!FD_ISSET(c->sock, &read_set) && !FD_ISSET(c->sock, &write_set)))
+                continue;
+            if (FD_ISSET(c->sock, &write_set))
+            {
+                xSemaphoreTake(client_mutex, portMAX_DELAY);
+                client_flush(c);
+                xSemaphoreGive(client_mutex);
+            }
+            if (FD_ISSET(c->sock, &read_set) && !c->closing)
+                client_receive(c);
         }
     }
 
-    // Exit
     xSemaphoreTake(client_mutex, portMAX_DELAY);
-    for (uint8_t i = 0;i < 3;i++)
-        if (client_socks[i] == sock)
+    for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
+        if (clients[i] != NULL)
         {
-            client_socks[i] = -1;
-            break;
+            shutdown(clients[i]->sock, SHUT_RDWR);
+            client_release(&clients[i]);
         }
-    shutdown(sock, 0);
-    close(sock);
-    ESP_LOGI("TCP_Server", "Client disconnected, task deleted");
+    xSemaphoreGive(client_mutex);
+    close(listen_sock);
     vTaskDelete(NULL);
 }
 
@@ -351,24 +1468,21 @@ void Init_WiFi(void)
  */
 void Init_TCPServer(void)
 {
-    char addr_str[128];
     int addr_family = AF_INET;
     int ip_protocol = IPPROTO_IP;
-    int keepAlive = 1;
-    int keepIdle = KEEPALIVE_IDLE;
-    int keepInterval = KEEPALIVE_INTERVAL;
-    int keepCount = KEEPALIVE_COUNT;
     struct sockaddr_in dest_addr = {
         .sin_addr.s_addr = htonl(INADDR_ANY),
         .sin_family = AF_INET,
         .sin_port = htons(CONFIG_SERVER_PORT),
     };
+    if (xEventGroupGetBits(s_wifi_event_group) & TCP_INIT_BIT)
+        return;
+
     ESP_LOGI("TCP_Server", "Initializing socket...");
     int listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
     if (listen_sock < 0)
     {
         ESP_LOGE("TCP_Server", "Unable to create socket: errno %d", errno);
-        vTaskDelete(NULL);
         return;
     }
 
@@ -386,58 +1500,84 @@ void Init_TCPServer(void)
     ESP_LOGI("TCP_Server", "Socket bound, port %d", CONFIG_SERVER_PORT);
 
     ESP_LOGI("TCP_Server", "Listening");
-    err = listen(listen_sock, 3);
+    err = listen(listen_sock, CONFIG_LISTEN_BACKLOG);
     if (err != 0)
     {
         ESP_LOGE("TCP_Server", "Error during listen: errno %d", errno);
         goto CLEAN_UP;
     }
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
     ESP_LOGI("TCP_Server", "Socket listening");
+    for (uint8_t i = 0;i < PENDING_SLOTS;i++)
+        pending_commands[i].sock = -1;
+    pending_mutex = xSemaphoreCreateMutex();
     client_mutex = xSemaphoreCreateMutex();
+    command_init();
+#ifdef CONFIG_TELEMETRY_UDP
+    udp_telemetry_init();
+#endif
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+    Init_WsServer();
+#endif
 
+    // One task serves every socket, the caller (WiFi event handler or Init_WiFi) returns right away
+    // 由一个任务服务所有套接字, 调用者(WiFi事件处理函数或Init_WiFi)立即返回
     xEventGroupSetBits(s_wifi_event_group, TCP_INIT_BIT);
+    xTaskCreate(Process_Data, "Process_Data", 4096, NULL, 6, NULL);
+    xTaskCreate(tcp_server_task, "tcp_server_task", 4096, (void*)listen_sock, 5, NULL);
+    return;
 
-    ESP_LOGI("TCP_Server", "Waiting for client connections...");
-    while (1)
-    {
-        struct sockaddr_in source_addr;
-        socklen_t addr_len = sizeof(source_addr);
+CLEAN_UP:
+    close(listen_sock);
+}
 
-        int sock = accept(listen_sock, (struct sockaddr*)&source_addr, &addr_len);
-        if (sock < 0)
-        {
-            ESP_LOGE("TCP_Server", "Unable to accept connection: errno %d", errno);
-            break;
-        }
-        inet_ntoa_r(source_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-        ESP_LOGI("TCP_Server", "Socket accepted, IP address: %s", addr_str);
+// Per-sample cache of the shared (non-delta) frames
+// 每个样本的共享(非增量)帧缓存
+typedef struct
+{
+    const Sample_t* sample;
+    int rssi;
+    int json_fields; // Field mask json_buf holds, -1 if none yet
+    int bin_fields;  // Field mask bin_buf holds, -1 if none yet
+    size_t json_len;
+    size_t bin_len;
+} FrameCache_t;
 
-        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+static char json_buf[TELEMETRY_JSON_MAX_LEN];
+static uint8_t bin_buf[TELEMETRY_BIN_MAX_LEN];
 
-        bool ClientAdded = false;
-        xSemaphoreTake(client_mutex, portMAX_DELAY);
-        for (uint8_t i = 0;i < 3;i++)
-            if (client_socks[i] < 0)
-            {
-                client_socks[i] = sock;
-                ClientAdded = true;
-                xSemaphoreGive(client_mutex);
-                break;
-            }
-        if (ClientAdded) xTaskCreate(handle_client_task, "handle_client_task", 4096, (void*)sock, 5, NULL);
-        else
+/**
+ * @brief Get the frame of the current sample for an encoding and field mask
+ * @param fc Cache of the current sample
+ * @param encoding Telemetry encoding
+ * @param fields TelemetryField mask
+ * @param len Frame length, 0 if encoding failed
+ * @retval Frame, valid until the cache is asked for another field mask of the same encoding
+ * @note Each encoding is cached with the field mask it was produced for, so every
+ *       consumer sharing a subscription, TCP or WebSocket, shares one encode per sample
+ */
+static const void* frame_cache_get(FrameCache_t* fc, TelemetryEncoding encoding, uint8_t fields, size_t* len)
+{
+    if (encoding == TELEMETRY_BINARY)
+    {
+        if (fc->bin_fields != fields)
         {
-            ESP_LOGW("TCP_Server", "Client list full, dropping new client");
-            shutdown(sock, 0);
-            close(sock);
+            fc->bin_len = telemetry_encode_binary(fc->sample, fc->rssi, fields, bin_buf, sizeof(bin_buf));
+            fc->bin_fields = fields;
         }
+        *len = fc->bin_len;
+        return bin_buf;
     }
-CLEAN_UP:
-    close(listen_sock);
-    vTaskDelete(NULL);
+
+    // Encode straight into a static buffer, nothing is allocated per sample
+    // 直接编码到静态缓冲区, 每个样本都不分配内存
+    if (fc->json_fields != fields)
+    {
+        fc->json_len = telemetry_encode_json(fc->sample, fc->rssi, fields, json_buf, sizeof(json_buf));
+        fc->json_fields = fields;
+    }
+    *len = fc->json_len;
+    return json_buf;
 }
 
 /**
@@ -447,10 +1587,11 @@ CLEAN_UP:
  */
 void Process_Data(void* pvParameters)
 {
+    static uint8_t client_buf[TELEMETRY_JSON_MAX_LEN]; // Frames specific to one client: delta and datagram
     while (1)
     {
-        SensorData_t* pData = NULL;
-        if (xQueueReceive(uart_queue, &pData, portMAX_DELAY) == pdPASS)
+        Sample_t sample;
+        if (uart_sample_receive(&sample, portMAX_DELAY))
         {
             EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
                 WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
@@ -460,70 +1601,97 @@ void Process_Data(void* pvParameters)
 
             if (bits & WIFI_CONNECTED_BIT)
             {
-                cJSON* root = cJSON_CreateObject();
-                if (root)
+                int wifi_rssi = -127;
+                esp_wifi_sta_get_rssi(&wifi_rssi);
+
+                FrameCache_t cache = { &sample, wifi_rssi, -1, -1, 0, 0 };
+                int64_t now = esp_timer_get_time();
+#ifdef CONFIG_TELEMETRY_PROFILE
+                telemetry_profile_json(&sample, wifi_rssi);
+#endif
+#ifdef CONFIG_TELEMETRY_UDP
+                // Datagrams first, so they never wait behind TCP backlogs
+                // 先发送数据报, 使其不必等待TCP积压
+                udp_telemetry_multicast(&sample, wifi_rssi);
+#endif
+                xSemaphoreTake(client_mutex, portMAX_DELAY);
+                for (uint8_t i = 0;i < CONFIG_MAX_CLIENTS;i++)
                 {
-                    cJSON_AddStringToObject(root, "type", "data");
-                    cJSON* data_obj = cJSON_CreateObject();
-                    if (data_obj)
+                    Client_t* c = clients[i];
+                    if (c == NULL || c->closing)
+                        continue;
+
+                    // Decimate before encoding. Advancing next_due by the interval keeps the
+                    // average rate exact despite sample jitter, a client that fell behind restarts
+                    // 编码前抽取. next_due按间隔递增, 在样本抖动时仍保持平均速率准确, 落后过多则重新计时
+                    if (c->interval_us)
                     {
-                        int wifi_rssi = -127;
-                        esp_wifi_sta_get_rssi(&wifi_rssi);
-                        cJSON_AddNumberToObject(data_obj, "WifiSignalStrength", wifi_rssi);
-                        cJSON_AddNumberToObject(data_obj, "Voltage", pData->Voltage);
-                        cJSON_AddNumberToObject(data_obj, "Temperature", pData->Temperature);
-
-                        cJSON* euler = cJSON_CreateObject();
-                        if (euler)
-                        {
-                            cJSON_AddNumberToObject(euler, "pitch", pData->euler.pitch);
-                            cJSON_AddNumberToObject(euler, "roll", pData->euler.roll);
-                            cJSON_AddNumberToObject(euler, "yaw", pData->euler.yaw);
-                            cJSON_AddItemToObject(data_obj, "euler", euler);
-                        }
-
-                        cJSON* motors = cJSON_CreateArray();
-                        if (motors)
-                        {
-                            for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
-                            {
-                                cJSON* motor = cJSON_CreateObject();
-                                if (motor)
-                                {
-                                    cJSON_AddNumberToObject(motor, "Speed", pData->Motor[i].Speed);
-
-                                    const char* dirStr = (pData->Motor[i].Direction == CW) ? "CW" : "CCW";
-                                    cJSON_AddStringToObject(motor, "Direction", dirStr);
-                                    cJSON_AddItemToArray(motors, motor);
-                                }
-                            }
-                            cJSON_AddItemToObject(data_obj, "Motor", motors);
-                        }
+                        if (now < c->next_due)
+                            continue;
+                        c->next_due += c->interval_us;
+                        if (c->next_due <= now)
+                            c->next_due = now + c->interval_us;
                     }
-                    cJSON_AddNumberToObject(data_obj, "Amps", pData->Amps);
-                    cJSON_AddItemToObject(root, "data", data_obj);
 
-                    char* json_str = cJSON_PrintUnformatted(root);
-                    if (json_str)
+#ifdef CONFIG_TELEMETRY_UDP
+                    if (c->udp_dest.sin_port)
                     {
-                        xSemaphoreTake(client_mutex, portMAX_DELAY);
-                        for (uint8_t i = 0;i < 3;i++)
-                            if (client_socks[i] >= 0)
-                            {
-                                int sent = send(client_socks[i], json_str, strlen(json_str), 0);
-                                if (sent < 0) ESP_LOGE("TCP_Server", "Error sending to client %d: errno %d", client_socks[i], errno);
-                            }
-                        xSemaphoreGive(client_mutex);
-                        free(json_str);
+                        size_t len = (c->encoding == TELEMETRY_BINARY)
+                            ? telemetry_encode_binary_stream(&sample, wifi_rssi, c->fields, c->udp_seq, 0, client_buf, sizeof(client_buf))
+                            : telemetry_encode_json_stream(&sample, wifi_rssi, c->fields, c->udp_seq, 0, (char*)client_buf, sizeof(client_buf));
+                        c->udp_seq++;
+                        if (len)
+                            udp_telemetry_send(&c->udp_dest, client_buf, len);
+                        continue;
                     }
-                    cJSON_Delete(root);
+#endif
+                    if (c->delta)
+                    {
+                        // Delta frames are specific to one client and never cached
+                        // 增量帧只属于单个客户端, 不做缓存
+                        bool keyframe;
+                        uint8_t changed = telemetry_delta_select(&c->delta_state, &sample.data, wifi_rssi, c->fields, &keyframe);
+                        if (changed == 0)
+                            continue;
+                        uint32_t dseq = c->delta_state.seq++;
+                        uint8_t flags = keyframe ? TELEMETRY_FLAG_KEYFRAME : TELEMETRY_FLAG_DELTA;
+                        size_t len = (c->encoding == TELEMETRY_BINARY)
+                            ? telemetry_encode_binary_stream(&sample, wifi_rssi, changed, dseq, flags, client_buf, sizeof(client_buf))
+                            : telemetry_encode_json_stream(&sample, wifi_rssi, changed, dseq, flags, (char*)client_buf, sizeof(client_buf));
+                        uint32_t dropped = c->frames_dropped;
+                        if (len)
+                            client_write(c, client_buf, len);
+                        // The client missed changes, resynchronise it with a keyframe
+                        // 客户端丢失了变化, 用关键帧重新同步
+                        if (c->frames_dropped != dropped)
+                            c->delta_state.key_due = true;
+                        continue;
+                    }
+
+                    size_t frame_len;
+                    const void* frame = frame_cache_get(&cache, c->encoding, c->fields, &frame_len);
+                    if (frame_len)
+                        client_write(c, frame, frame_len);
                 }
+                xSemaphoreGive(client_mutex);
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+                // WebSocket clients get the full-rate frames TCP clients already caused to be encoded
+                // WebSocket客户端使用与TCP客户端相同的全速率帧, 已编码的直接复用
+                uint8_t ws_encodings = ws_server_encodings();
+                for (uint8_t e = TELEMETRY_JSON;e <= TELEMETRY_BINARY;e++)
+                    if (ws_encodings & (1 << e))
+                    {
+                        size_t frame_len;
+                        const void* frame = frame_cache_get(&cache, e, TELEMETRY_FIELDS_ALL, &frame_len);
+                        if (frame_len)
+                            ws_server_broadcast(e, frame, frame_len);
+                    }
+#endif
             }
             else
             {
                 ESP_LOGE("TCP_Server", "WiFi not ready, skipping broadcast");
             }
-            free(pData);
         }
     }
     vTaskDelete(NULL);
@@ -0,0 +1,526 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "command.h"
+
+// A view into the message, tokens are never copied or terminated
+// 消息的一个视图, 参数既不拷贝也不写入结束符
+typedef struct
+{
+    const char* p;
+    const char* end;
+} CmdCursor_t;
+
+typedef struct
+{
+    const char* s;
+    size_t len;
+} CmdToken_t;
+
+/**
+ * @brief Get the next space separated token
+ * @param cur Cursor, advanced past the token
+ * @param tok Token
+ * @retval false if the message has no more tokens
+ */
+static bool next_token(CmdCursor_t* cur, CmdToken_t* tok)
+{
+    while (cur->p < cur->end && (*cur->p == ' ' || *cur->p == '\t'))
+        cur->p++;
+    if (cur->p == cur->end || *cur->p == '\0')
+        return false;
+    tok->s = cur->p;
+    while (cur->p < cur->end && *cur->p != ' ' && *cur->p != '\t' && *cur->p != '\0')
+        cur->p++;
+    tok->len = cur->p - tok->s;
+    return true;
+}
+
+/**
+ * @brief Parse the next token as a decimal integer
+ * @param cur Cursor
+ * @param out Value
+ * @retval CMD_OK, CMD_ERR_MISSING_ARG or CMD_ERR_BAD_INT
+ * @note Unlike atoi, anything but an optional sign followed by digits is rejected,
+ *       and so is a value that does not fit an int32_t
+ */
+static CommandStatus get_int(CmdCursor_t* cur, int32_t* out)
+{
+    CmdToken_t tok;
+    if (!next_token(cur, &tok))
+        return CMD_ERR_MISSING_ARG;
+
+    size_t i = 0;
+    bool neg = false;
+    if (tok.s[0] == '-' || tok.s[0] == '+')
+    {
+        neg = tok.s[0] == '-';
+        i++;
+    }
+    if (i == tok.len)
+        return CMD_ERR_BAD_INT;
+
+    // Accumulate the magnitude so INT32_MIN is accepted without overflow
+    // 按绝对值累加, 使INT32_MIN也能被接受而不溢出
+    uint32_t limit = neg ? 0u - (uint32_t)INT32_MIN : (uint32_t)INT32_MAX;
+    uint32_t v = 0;
+    for (;i < tok.len;i++)
+    {
+        uint32_t d = (uint32_t)(tok.s[i] - '0');
+        if (d > 9 || v > (limit - d) / 10)
+            return CMD_ERR_BAD_INT;
+        v = v * 10 + d;
+    }
+    *out = neg ? (int32_t)(0u - v) : (int32_t)v;
+    return CMD_OK;
+}
+
+/**
+ * @brief Parse the next token as a single character
+ * @param cur Cursor
+ * @param out Character
+ * @retval CMD_OK, CMD_ERR_MISSING_ARG or CMD_ERR_BAD_CHAR
+ */
+static CommandStatus get_char(CmdCursor_t* cur, char* out)
+{
+    CmdToken_t tok;
+    if (!next_token(cur, &tok))
+        return CMD_ERR_MISSING_ARG;
+    if (tok.len != 1)
+        return CMD_ERR_BAD_CHAR;
+    *out = tok.s[0];
+    return CMD_OK;
+}
+
+/**
+ * @brief Copy the next token into a NUL terminated field
+ * @param cur Cursor
+ * @param out Field
+ * @param size Size of the field, including the terminator
+ * @retval CMD_OK, CMD_ERR_MISSING_ARG or CMD_ERR_TOO_LONG
+ */
+static CommandStatus get_str(CmdCursor_t* cur, char* out, size_t size)
+{
+    CmdToken_t tok;
+    if (!next_token(cur, &tok))
+        return CMD_ERR_MISSING_ARG;
+    if (tok.len >= size)
+        return CMD_ERR_TOO_LONG;
+    memcpy(out, tok.s, tok.len);
+    out[tok.len] = '\0';
+    return CMD_OK;
+}
+
+typedef enum
+{
+    ARG_INT,
+    ARG_CHAR,
+    ARG_STR,
+} CommandArgKind;
+
+// Schema of one argument, generated from the command table
+// 单个参数的模式, 由命令表生成
+typedef struct
+{
+    uint8_t kind;      // CommandArgKind
+    uint16_t offset;   // Offset of the field in CommandParams
+    int32_t min;       // INT: smallest value, STR: shortest length
+    int32_t max;       // INT: largest value, STR: longest length
+    const char* set;   // CHAR, STR: allowed characters
+    uint8_t width;     // INT: bytes in a command frame
+} CommandArg_t;
+
+typedef struct
+{
+    const char* name;
+    uint8_t name_len;
+    uint8_t argc;
+    const CommandArg_t* args;
+} CommandDef_t;
+
+#define COMMAND_ARG_INT(C, field, a, b) { ARG_INT, offsetof(CommandParams, C.field), (a), (b), NULL, COMMAND_INT_WIDTH(a, b) },
+#define COMMAND_ARG_CHAR(C, field, a, b) { ARG_CHAR, offsetof(CommandParams, C.field), 0, 0, (a), 1 },
+#define COMMAND_ARG_STR(C, field, a, b) { ARG_STR, offsetof(CommandParams, C.field), 1, (b), (a), 0 },
+#define COMMAND_ARG(C, kind, field, a, b) COMMAND_ARG_##kind(C, field, a, b)
+
+_Static_assert(COMMAND_PAYLOAD_MAX_LEN <= UART_FRAME_MAX_PAYLOAD, "A command does not fit a UART frame");
+
+#define COMMAND_ARGS(ID, name, Type, ARGS) static const CommandArg_t name##_args[] = { ARGS(COMMAND_ARG, name) };
+COMMAND_TABLE(COMMAND_ARGS)
+#undef COMMAND_ARGS
+
+static const CommandDef_t command_defs[CMD_COUNT] = {
+#define COMMAND_DEF(ID, name, Type, ARGS) \
+    [CMD_##ID] = { #name, sizeof(#name) - 1, sizeof(name##_args) / sizeof(name##_args[0]), name##_args },
+    COMMAND_TABLE(COMMAND_DEF)
+#undef COMMAND_DEF
+};
+
+// Open addressing index of the names, a slot holds CommandType + 1, 0 when empty.
+// Names cannot be hashed at compile time in C, command_init builds it once.
+// 命令名的开放寻址索引, 槽位存放CommandType + 1, 空槽为0. C语言无法在编译期对字符串求哈希, 由command_init构建一次.
+#define COMMAND_HASH_SIZE (32)
+_Static_assert(CMD_COUNT * 2 <= COMMAND_HASH_SIZE, "Grow COMMAND_HASH_SIZE with the command table");
+static uint8_t command_index[COMMAND_HASH_SIZE];
+
+static unsigned command_hash(const char* name, size_t len)
+{
+    return (unsigned)(len + (uint8_t)name[0] * 3 + (uint8_t)name[len - 1] * 5) & (COMMAND_HASH_SIZE - 1);
+}
+
+/**
+ * @brief Build the name index of the command table
+ * @retval None
+ * @note Call once before the first parse_command or command_lookup, the index is
+ *       only read afterwards
+ */
+void command_init(void)
+{
+    memset(command_index, 0, sizeof(command_index));
+    for (uint8_t i = 0;i < CMD_COUNT;i++)
+    {
+        unsigned h = command_hash(command_defs[i].name, command_defs[i].name_len);
+        while (command_index[h])
+            h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+        command_index[h] = i + 1;
+    }
+}
+
+/**
+ * @brief Find a command by name
+ * @param name Command word, need not be NUL terminated
+ * @param len Length of name
+ * @retval Command type, CMD_UNKNOWN if there is no such command
+ * @note With the table at most half full this is one hash and usually one compare
+ */
+CommandType command_lookup(const char* name, size_t len)
+{
+    if (len == 0)
+        return CMD_UNKNOWN;
+    unsigned h = command_hash(name, len);
+    while (command_index[h])
+    {
+        const CommandDef_t* def = &command_defs[command_index[h] - 1];
+        if (def->name_len == len && memcmp(def->name, name, len) == 0)
+            return (CommandType)(command_index[h] - 1);
+        h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+    }
+    return CMD_UNKNOWN;
+}
+
+/**
+ * @brief Get the command word of a command type
+ * @param type Command type
+ * @retval Name, "?" for CMD_UNKNOWN
+ */
+const char* command_name(CommandType type)
+{
+    return (type < CMD_COUNT) ? command_defs[type].name : "?";
+}
+
+static bool in_set(const char* set, char c)
+{
+    return c != '\0' && (set == NULL || strchr(set, c) != NULL);
+}
+
+/**
+ * @brief Check a command against the schema of its arguments
+ * @param cmd Command, parsed or built by other means
+ * @retval CMD_OK, CMD_ERR_UNKNOWN or CMD_ERR_RANGE
+ */
+CommandStatus command_validate(const Command* cmd)
+{
+    if (cmd->type >= CMD_COUNT)
+        return CMD_ERR_UNKNOWN;
+
+    const CommandDef_t* def = &command_defs[cmd->type];
+    const uint8_t* base = (const uint8_t*)&cmd->params;
+    for (uint8_t i = 0;i < def->argc;i++)
+    {
+        const CommandArg_t* arg = &def->args[i];
+        const void* field = base + arg->offset;
+        if (arg->kind == ARG_INT)
+        {
+            int32_t v;
+            memcpy(&v, field, sizeof(v));
+            if (v < arg->min || v > arg->max)
+                return CMD_ERR_RANGE;
+        }
+        else if (arg->kind == ARG_CHAR)
+        {
+            if (!in_set(arg->set, *(const char*)field))
+                return CMD_ERR_RANGE;
+        }
+        else
+        {
+            const char* str = field;
+            size_t n = strnlen(str, (size_t)arg->max + 1);
+            if (n < (size_t)arg->min || n > (size_t)arg->max)
+                return CMD_ERR_RANGE;
+            for (size_t k = 0;k < n;k++)
+                if (!in_set(arg->set, str[k]))
+                    return CMD_ERR_RANGE;
+        }
+    }
+    return CMD_OK;
+}
+
+/**
+ * @brief Parse a console command
+ * @param msg Command text, need not be NUL terminated
+ * @param len Length of msg, parsing also stops at a NUL
+ * @param out Parsed command, type is CMD_UNKNOWN unless CMD_OK is returned
+ * @retval CMD_OK or the reason the command was rejected
+ * @note Reentrant and allocation free: the message is only read, tokens are
+ *       spans into it. Every argument is required, checked for its type and then
+ *       validated against the schema of the command.
+ */
+CommandStatus parse_command(const char* msg, size_t len, Command* out)
+{
+    CmdCursor_t cur = { msg, msg + len };
+    CmdToken_t word;
+    Command cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    out->type = CMD_UNKNOWN;
+    if (!next_token(&cur, &word))
+        return CMD_ERR_EMPTY;
+
+    cmd.type = command_lookup(word.s, word.len);
+    if (cmd.type == CMD_UNKNOWN)
+        return CMD_ERR_UNKNOWN;
+
+    const CommandDef_t* def = &command_defs[cmd.type];
+    uint8_t* base = (uint8_t*)&cmd.params;
+    for (uint8_t i = 0;i < def->argc;i++)
+    {
+        const CommandArg_t* arg = &def->args[i];
+        CommandStatus status;
+        if (arg->kind == ARG_INT)
+        {
+            int32_t v = 0;
+            status = get_int(&cur, &v);
+            memcpy(base + arg->offset, &v, sizeof(v));
+        }
+        else if (arg->kind == ARG_CHAR)
+            status = get_char(&cur, (char*)(base + arg->offset));
+        else
+            status = get_str(&cur, (char*)(base + arg->offset), (size_t)arg->max + 1);
+        if (status != CMD_OK)
+            return status;
+    }
+
+    if (next_token(&cur, &word))
+        return CMD_ERR_EXTRA_ARG;
+    CommandStatus status = command_validate(&cmd);
+    if (status != CMD_OK)
+        return status;
+    *out = cmd;
+    return CMD_OK;
+}
+
+/**
+ * @brief Fill in the canonical emergency stop
+ * @param out Command
+ * @retval None
+ */
+static void command_estop(Command* out)
+{
+    memset(out, 0, sizeof(*out));
+    out->type = CMD_MOVE;
+    out->params.move.stop = 1;
+    out->params.move.sd = 'S';
+    out->params.move.wasd[0] = 'W';
+}
+
+/**
+ * @brief Recognise an emergency stop from its first argument alone
+ * @param msg Command text, need not be NUL terminated
+ * @param len Length of msg
+ * @param out Canonical stop, written only if true is returned
+ * @retval true if msg is "move 1" followed by anything
+ * @note A stop must never be lost to a missing or out of range argument, so the
+ *       rest of the command is not looked at and a fixed, valid stop is built.
+ */
+bool command_parse_estop(const char* msg, size_t len, Command* out)
+{
+    CmdCursor_t cur = { msg, msg + len };
+    CmdToken_t word;
+    int32_t stop;
+
+    if (!next_token(&cur, &word) || command_lookup(word.s, word.len) != CMD_MOVE)
+        return false;
+    if (get_int(&cur, &stop) != CMD_OK || stop != 1)
+        return false;
+    command_estop(out);
+    return true;
+}
+
+/**
+ * @brief Recognise an emergency stop in a command frame payload from its first argument alone
+ * @param payload Command frame payload
+ * @param len Payload length
+ * @param out Canonical stop, written only if true is returned
+ * @retval true if the payload is a move whose stop argument is 1
+ */
+bool command_unpack_estop(const uint8_t* payload, size_t len, Command* out)
+{
+    const CommandArg_t* stop = &command_defs[CMD_MOVE].args[0];
+    if (len < 1u + stop->width || payload[0] != CMD_MOVE)
+        return false;
+    uint32_t u = 0;
+    for (uint8_t k = 0;k < stop->width;k++)
+        u |= (uint32_t)payload[1 + k] << (8 * k);
+    if (u != 1)
+        return false;
+    command_estop(out);
+    return true;
+}
+
+/**
+ * @brief Describe a parse result
+ * @param status Result of parse_command
+ * @retval Static string
+ */
+const char* command_status_str(CommandStatus status)
+{
+    switch (status)
+    {
+    case CMD_OK: return "ok";
+    case CMD_ERR_EMPTY: return "empty command";
+    case CMD_ERR_UNKNOWN: return "unknown command";
+    case CMD_ERR_MISSING_ARG: return "missing argument";
+    case CMD_ERR_EXTRA_ARG: return "too many arguments";
+    case CMD_ERR_BAD_INT: return "invalid integer";
+    case CMD_ERR_BAD_CHAR: return "expected a single character";
+    case CMD_ERR_TOO_LONG: return "argument too long";
+    case CMD_ERR_RANGE: return "argument out of range";
+    }
+    return "?";
+}
+
+/**
+ * @brief Serialize a command into a command frame payload
+ * @param cmd Validated command
+ * @param out Output buffer, COMMAND_PAYLOAD_MAX_LEN bytes are always enough
+ * @param size Size of the output buffer
+ * @retval Payload length, 0 if the command type is invalid or out is too small
+ */
+size_t command_pack(const Command* cmd, uint8_t* out, size_t size)
+{
+    if (cmd->type >= CMD_COUNT || size < COMMAND_PAYLOAD_MAX_LEN)
+        return 0;
+
+    const CommandDef_t* def = &command_defs[cmd->type];
+    const uint8_t* base = (const uint8_t*)&cmd->params;
+    uint8_t* p = out;
+    *p++ = (uint8_t)cmd->type;
+    for (uint8_t i = 0;i < def->argc;i++)
+    {
+        const CommandArg_t* arg = &def->args[i];
+        const void* field = base + arg->offset;
+        if (arg->kind == ARG_INT)
+        {
+            int32_t v;
+            memcpy(&v, field, sizeof(v));
+            for (uint8_t k = 0;k < arg->width;k++)
+                *p++ = (uint8_t)((uint32_t)v >> (8 * k));
+        }
+        else if (arg->kind == ARG_CHAR)
+            *p++ = *(const uint8_t*)field;
+        else
+        {
+            size_t n = strnlen(field, (size_t)arg->max);
+            *p++ = (uint8_t)n;
+            memcpy(p, field, n);
+            p += n;
+        }
+    }
+    return p - out;
+}
+
+/**
+ * @brief Deserialize and validate a command frame payload
+ * @param payload Payload of a UART_FRAME_COMMAND frame
+ * @param len Payload length
+ * @param out Command, type is CMD_UNKNOWN unless CMD_OK is returned
+ * @retval CMD_OK or the reason the payload was rejected
+ */
+CommandStatus command_unpack(const uint8_t* payload, size_t len, Command* out)
+{
+    Command cmd;
+    const uint8_t* p = payload;
+    const uint8_t* end = payload + len;
+
+    memset(&cmd, 0, sizeof(cmd));
+    out->type = CMD_UNKNOWN;
+    if (len == 0)
+        return CMD_ERR_EMPTY;
+    if (*p >= CMD_COUNT)
+        return CMD_ERR_UNKNOWN;
+    cmd.type = (CommandType)*p++;
+
+    const CommandDef_t* def = &command_defs[cmd.type];
+    uint8_t* base = (uint8_t*)&cmd.params;
+    for (uint8_t i = 0;i < def->argc;i++)
+    {
+        const CommandArg_t* arg = &def->args[i];
+        uint8_t* field = base + arg->offset;
+        if (arg->kind == ARG_INT)
+        {
+            if (end - p < arg->width)
+                return CMD_ERR_MISSING_ARG;
+            uint32_t u = 0;
+            for (uint8_t k = 0;k < arg->width;k++)
+                u |= (uint32_t)*p++ << (8 * k);
+            // Sign-extend from the wire width
+            // 按线上宽度进行符号扩展
+            uint8_t shift = 32 - 8 * arg->width;
+            int32_t v = (int32_t)(u << shift) >> shift;
+            memcpy(field, &v, sizeof(v));
+        }
+        else if (arg->kind == ARG_CHAR)
+        {
+            if (p == end)
+                return CMD_ERR_MISSING_ARG;
+            *field = *p++;
+        }
+        else
+        {
+            if (p == end || end - p - 1 < *p)
+                return CMD_ERR_MISSING_ARG;
+            uint8_t n = *p++;
+            if (n > arg->max)
+                return CMD_ERR_TOO_LONG;
+            memcpy(field, p, n);
+            field[n] = '\0';
+            p += n;
+        }
+    }
+
+    if (p != end)
+        return CMD_ERR_EXTRA_ARG;
+    CommandStatus status = command_validate(&cmd);
+    if (status != CMD_OK)
+        return status;
+    *out = cmd;
+    return CMD_OK;
+}
+
+/**
+ * @brief Build the complete UART frame of a command
+ * @param cmd Validated command
+ * @param seq Frame sequence number
+ * @param out Output buffer, COMMAND_FRAME_MAX_LEN bytes are always enough
+ * @param size Size of the output buffer
+ * @retval Frame length, 0 if the command type is invalid or out is too small
+ */
+size_t command_encode_frame(const Command* cmd, uint8_t seq, uint8_t* out, size_t size)
+{
+    uint8_t payload[COMMAND_PAYLOAD_MAX_LEN];
+    size_t len = command_pack(cmd, payload, sizeof(payload));
+    if (len == 0)
+        return 0;
+    return uart_frame_encode(UART_FRAME_COMMAND, seq, payload, (uint8_t)len, out, size);
+}
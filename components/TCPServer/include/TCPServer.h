@@ -7,6 +7,10 @@
 #ifndef _TCPSERVER_H_
 #define _TCPSERVER_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum
 {
     CW,
@@ -34,54 +38,16 @@ typedef struct
     float Amps;
 } SensorData_t;
 
-typedef enum
-{
-    CMD_MOVE,
-    CMD_SPIN,
-    CMD_MOTOR,
-    CMD_UNKNOWN
-} CommandType;
-
-typedef struct
-{
-    int stop;         // move 命令中的 Stop 参数（是否急停，0表示不急停，1表示急停）
-    char sd;          // move 命令中的 S/D 参数（例如用字符 'S' 表示速度模式，'D' 表示距离模式）
-    char wasd[16];    // move 命令中的方向参数，可能是组合的 "W", "A", "S", "D"
-    int value;        // move 命令中的 Value 参数
-    int time;         // move 命令中的 Time 参数（如果为速度模式，运行时间；0表示无限）
-} MoveParams;
-
-typedef struct
-{
-    char lr;          // spin 命令中的 L/R 参数， 'L' 或 'R'
-    int angle;        // spin 命令中的角度参数
-} SpinParams;
-
-typedef struct
-{
-    int motorID;      // motor 命令中的 MotorID
-    char dir;         // motor 命令中的 Dir 参数，'C'（CW）或 'C'（CCW），可根据需要修改
-    int angle;        // motor 命令中的 Angle 参数
-} MotorParams;
-
-// 使用联合体存储不同类型命令的参数
-typedef union
-{
-    MoveParams move;
-    SpinParams spin;
-    MotorParams motor;
-} CommandParams;
-
-// 定义最终的命令结构体
-typedef struct
-{
-    CommandType type;
-    CommandParams params;
-} Command;
-
-
 void Init_WiFi(void);
 void Init_TCPServer(void);
-Command parse_command(const char* msg);
+void Process_Data(void* pvParameters);
+
+struct cJSON;
+void Process_Client_Data(int sock, const char* json_input, size_t len, int64_t rx_at);
+void Process_Client_Message(int sock, const struct cJSON* root, int64_t rx_at);
+bool Process_EStop(int sock, const char* json, size_t len, int64_t rx_at);
+void Process_Client_Binary(int sock, const uint8_t* msg, size_t len, int64_t rx_at);
+void Process_Controller_Reply(uint8_t seq, bool ok);
+void Forget_Client_Commands(int sock);
 
 #endif // _TCPSERVER_H_
\ No newline at end of file
@@ -0,0 +1,144 @@
+/*
+    command.h
+    Console commands clients send in the "Msg" field: the command table, its
+    parser and the command frame sent to the controller.
+    The parser works in place on a bounded span: it keeps no state between
+    calls, allocates nothing and never writes to its input, so any number of
+    tasks may call it at the same time.
+
+    Command frame: a UART frame (see uart_frame.h) of type UART_FRAME_COMMAND,
+    payload | Command (u8) | arguments in table order |, where an INT argument
+    takes the narrowest signed little-endian width (1, 2 or 4 bytes) its range
+    fits, a CHAR one byte and a STR a length byte followed by its characters.
+    This file has no ESP-IDF dependency so it can also be built on the host.
+*/
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#include "uart_frame.h"
+
+/*
+    Command table, one X(ID, name, ParamsType, ARGS) entry per command.
+    ARGS(ARG, C) expands ARG(C, kind, field, a, b) for every argument, in the
+    order they are written in the command:
+        INT  int32_t field, a <= value <= b
+        CHAR char field, one of the characters of the string a, any if a is NULL
+        STR  char field[b + 1], 1 to b characters, each one of the string a
+    A bound is only set where the meaning of the argument fixes it, any other
+    value is left for the controller to judge.
+    Adding a command only takes a new entry and its argument list.
+    命令表, 每个命令一项. 新增命令只需添加一项及其参数列表.
+*/
+#define COMMAND_TABLE(X) \
+    X(MOVE, move, MoveParams, COMMAND_MOVE_ARGS) \
+    X(SPIN, spin, SpinParams, COMMAND_SPIN_ARGS) \
+    X(MOTOR, motor, MotorParams, COMMAND_MOTOR_ARGS)
+
+// move [Stop] [S/D] [WASD] [Value] [Time]
+#define COMMAND_MOVE_ARGS(ARG, C) \
+    ARG(C, INT, stop, 0, 1)                     /* 是否急停, 0表示不急停, 1表示急停 */ \
+    ARG(C, CHAR, sd, "SD", 0)                   /* S 速度模式, D 距离模式 */ \
+    ARG(C, STR, wasd, "WASD", 15)               /* 方向, "W", "A", "S", "D" 可组合 */ \
+    ARG(C, INT, value, INT32_MIN, INT32_MAX)    /* 速度或距离 */ \
+    ARG(C, INT, time, INT32_MIN, INT32_MAX)     /* 速度模式下的运行时间, 0表示无限 */
+
+// spin [L/R] [Angle]
+#define COMMAND_SPIN_ARGS(ARG, C) \
+    ARG(C, CHAR, lr, "LR", 0)                   /* 向左或向右 */ \
+    ARG(C, INT, angle, INT32_MIN, INT32_MAX)    /* 角度 */
+
+// motor [MotorID] [Dir] [Angle]
+#define COMMAND_MOTOR_ARGS(ARG, C) \
+    ARG(C, INT, motorID, 1, CONFIG_MOTOR_COUNT) /* Motor_1 至 Motor_N */ \
+    ARG(C, CHAR, dir, NULL, 0)                  /* 方向, 由控制器解释 */ \
+    ARG(C, INT, angle, INT32_MIN, INT32_MAX)
+
+#define COMMAND_FIELD_INT(field, a, b) int32_t field;
+#define COMMAND_FIELD_CHAR(field, a, b) char field;
+#define COMMAND_FIELD_STR(field, a, b) char field[(b) + 1];
+#define COMMAND_FIELD(C, kind, field, a, b) COMMAND_FIELD_##kind(field, a, b)
+
+#define COMMAND_PARAMS_STRUCT(ID, name, Type, ARGS) typedef struct { ARGS(COMMAND_FIELD, name) } Type;
+COMMAND_TABLE(COMMAND_PARAMS_STRUCT)
+#undef COMMAND_PARAMS_STRUCT
+
+typedef enum
+{
+#define COMMAND_ENUM(ID, name, Type, ARGS) CMD_##ID,
+    COMMAND_TABLE(COMMAND_ENUM)
+#undef COMMAND_ENUM
+    CMD_UNKNOWN,
+    CMD_COUNT = CMD_UNKNOWN
+} CommandType;
+
+// 使用联合体存储不同类型命令的参数
+typedef union
+{
+#define COMMAND_UNION(ID, name, Type, ARGS) Type name;
+    COMMAND_TABLE(COMMAND_UNION)
+#undef COMMAND_UNION
+} CommandParams;
+
+// 定义最终的命令结构体
+typedef struct
+{
+    CommandType type;
+    CommandParams params;
+} Command;
+
+// Bytes an argument takes in a command frame
+// 参数在命令帧中占用的字节数
+#define COMMAND_INT_WIDTH(a, b) (((a) >= -128 && (b) <= 127) ? 1 : ((a) >= -32768 && (b) <= 32767) ? 2 : 4)
+#define COMMAND_WIRE_INT(a, b) COMMAND_INT_WIDTH(a, b)
+#define COMMAND_WIRE_CHAR(a, b) 1
+#define COMMAND_WIRE_STR(a, b) (1 + (b))
+#define COMMAND_WIRE(C, kind, field, a, b) COMMAND_WIRE_##kind(a, b) +
+
+// Sized like the longest command payload, never instantiated
+// 大小等于最长的命令负载, 仅用于计算长度
+typedef union
+{
+#define COMMAND_WIRE_SIZE(ID, name, Type, ARGS) uint8_t name[1 + ARGS(COMMAND_WIRE, name) 0];
+    COMMAND_TABLE(COMMAND_WIRE_SIZE)
+#undef COMMAND_WIRE_SIZE
+} CommandWireSize_u;
+
+#define COMMAND_PAYLOAD_MAX_LEN (sizeof(CommandWireSize_u))
+#define COMMAND_FRAME_MAX_LEN (UART_FRAME_HEADER_LEN + COMMAND_PAYLOAD_MAX_LEN + UART_FRAME_CRC_LEN)
+
+typedef enum
+{
+    CMD_OK = 0,
+    CMD_ERR_EMPTY,       // No command word
+    CMD_ERR_UNKNOWN,     // Command word not recognised
+    CMD_ERR_MISSING_ARG, // Fewer arguments than the command takes
+    CMD_ERR_EXTRA_ARG,   // More arguments than the command takes
+    CMD_ERR_BAD_INT,     // Not a decimal integer, or out of range
+    CMD_ERR_BAD_CHAR,    // Not a single character
+    CMD_ERR_TOO_LONG,    // Text argument longer than its field
+    CMD_ERR_RANGE,       // Argument outside the range or character set of its schema
+} CommandStatus;
+
+void command_init(void);
+CommandType command_lookup(const char* name, size_t len);
+const char* command_name(CommandType type);
+
+CommandStatus parse_command(const char* msg, size_t len, Command* out);
+CommandStatus command_validate(const Command* cmd);
+const char* command_status_str(CommandStatus status);
+bool command_parse_estop(const char* msg, size_t len, Command* out);
+bool command_unpack_estop(const uint8_t* payload, size_t len, Command* out);
+
+size_t command_pack(const Command* cmd, uint8_t* out, size_t size);
+CommandStatus command_unpack(const uint8_t* payload, size_t len, Command* out);
+size_t command_encode_frame(const Command* cmd, uint8_t seq, uint8_t* out, size_t size);
+
+#endif // _COMMAND_H_
@@ -0,0 +1,54 @@
+/*
+    msg_framer.h
+    Splits the client command byte stream into complete JSON messages.
+    Messages are top-level JSON objects, optionally separated by newlines
+    (newline-delimited JSON). Objects sent back to back are split as well,
+    so clients that never sent a delimiter keep working.
+    A message starting with MSG_BIN_MAGIC instead of '{' is a binary command:
+        | 0xC5 | Len (u8) | Id (u32 LE) | Payload[Len] |
+    where Payload is the payload of a command frame (see command.h). Binary
+    and JSON messages may be mixed on one connection. Bytes in front of a
+    message are dropped one at a time until the next '{' or MSG_BIN_MAGIC.
+*/
+
+#ifndef _MSG_FRAMER_H_
+#define _MSG_FRAMER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#define MSG_BIN_MAGIC (0xC5)
+#define MSG_BIN_HEADER_LEN (6)
+
+typedef struct
+{
+    char buf[CONFIG_CLIENT_RX_BUFFER_SIZE];
+    size_t len;     // Bytes buffered
+    size_t scan;    // Bytes already scanned
+    size_t start;   // Start of the message being scanned
+    int depth;      // Object/array nesting depth, 0 outside a message
+    bool in_str;
+    bool esc;
+    bool oversized; // Dropping the rest of a JSON message that did not fit, up to its end
+    bool junk;      // Dropping bytes in front of a message, the run is counted once
+    size_t discard; // Bytes of an oversized binary message still to be dropped
+    bool partial;   // Waiting for the rest of a binary message that starts at start
+    unsigned dropped;
+} MsgFramer_t;
+
+/**
+ * @brief Called for every complete message
+ * @param msg Message bytes, not NUL terminated, only valid during the call
+ * @param len Message length
+ * @param ctx User context
+ */
+typedef void (*MsgHandler)(const char* msg, size_t len, void* ctx);
+
+void msg_framer_init(MsgFramer_t* f);
+char* msg_framer_buffer(MsgFramer_t* f, size_t* space);
+unsigned msg_framer_commit(MsgFramer_t* f, size_t n, MsgHandler handler, void* ctx);
+
+#endif // _MSG_FRAMER_H_
@@ -0,0 +1,95 @@
+/*
+    telemetry.h
+    Encoders for the sensor telemetry sent to clients.
+*/
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "TCPServer.h"
+#include "sample_ring.h"
+#include "uart_frame.h"
+
+// Upper bound of one JSON telemetry message, every number takes at most 24 characters
+// 单条JSON遥测消息长度上限, 每个数字最多24个字符
+#define TELEMETRY_JSON_MAX_LEN (400 + 64 * CONFIG_MOTOR_COUNT)
+
+// Binary telemetry frame: | 0xB5 | Schema | Len (u16 LE) | Payload[Len] |
+// Every payload starts with Seq (u32), the global sample number, and Timestamp (u64),
+// the device time in us at which the sample's last UART byte arrived.
+// Schema 5 payload: Seq, Timestamp, RSSI (int8), then the UART sensor frame payload
+// Schema 6 payload: Seq, Timestamp, field mask (u8), then the selected fields in schema 5 order
+// Schema 7 payload: Seq, Timestamp, DSeq (u32), Flags (u8), then the field mask and fields as in
+// schema 6. DSeq counts the frames of one delta or datagram stream, so loss on it is visible.
+// 二进制遥测帧, 每个负载以全局样本序号Seq(u32)和时间戳Timestamp(u64, 样本最后一个串口字节到达的设备时间, 微秒)开头.
+// 模式5: Seq, Timestamp, RSSI(int8), 串口传感器帧负载; 模式6: Seq, Timestamp, 字段掩码(u8), 按模式5顺序排列的所选字段;
+// 模式7: Seq, Timestamp, 流序号DSeq(u32), 标志(u8), 之后与模式6相同, 用于增量模式与数据报
+#define TELEMETRY_BIN_MAGIC (0xB5)
+#define TELEMETRY_BIN_SCHEMA (5)
+#define TELEMETRY_BIN_SCHEMA_FIELDS (6)
+#define TELEMETRY_BIN_SCHEMA_STREAM (7)
+#define TELEMETRY_BIN_HEADER_LEN (4)
+#define TELEMETRY_BIN_STAMP_LEN (12)
+// Largest prefix (schema 7) plus field mask and RSSI
+// 最长的前缀(模式7)加字段掩码与RSSI
+#define TELEMETRY_BIN_MAX_LEN (TELEMETRY_BIN_HEADER_LEN + TELEMETRY_BIN_STAMP_LEN + 5 + 1 + 1 + UART_FRAME_SENSOR_PAYLOAD_LEN)
+
+// Flags of a stream frame
+// 流帧标志
+#define TELEMETRY_FLAG_KEYFRAME (0x01) // Carries every subscribed field of a delta stream
+#define TELEMETRY_FLAG_DELTA (0x02)    // Carries only the fields that changed
+
+// Telemetry fields a client can subscribe to, named after their JSON keys
+// 客户端可订阅的遥测字段, 以其JSON键命名
+typedef enum
+{
+    TELEMETRY_FIELD_RSSI = 1 << 0,        // WifiSignalStrength
+    TELEMETRY_FIELD_VOLTAGE = 1 << 1,     // Voltage
+    TELEMETRY_FIELD_TEMPERATURE = 1 << 2, // Temperature
+    TELEMETRY_FIELD_EULER = 1 << 3,       // euler
+    TELEMETRY_FIELD_MOTOR = 1 << 4,       // Motor
+    TELEMETRY_FIELD_AMPS = 1 << 5,        // Amps
+} TelemetryField;
+
+#define TELEMETRY_FIELD_COUNT (6)
+#define TELEMETRY_FIELDS_ALL ((1 << TELEMETRY_FIELD_COUNT) - 1)
+
+extern const char* const telemetry_field_names[TELEMETRY_FIELD_COUNT];
+
+// Per-client state of delta mode
+// 增量模式下每个客户端的状态
+typedef struct
+{
+    SensorData_t ref;                         // Value of every field as last sent
+    int ref_rssi;
+    float deadband[TELEMETRY_FIELD_COUNT];    // Indexed by bit position of TelemetryField
+    uint32_t seq;                             // Stream sequence number (DSeq) of the next frame
+    uint16_t since_key;                       // Samples since the last keyframe
+    bool key_due;                             // Next frame must be a keyframe
+} TelemetryDelta_t;
+
+typedef enum
+{
+    TELEMETRY_JSON,
+    TELEMETRY_BINARY,
+} TelemetryEncoding;
+
+uint8_t telemetry_field_from_name(const char* name);
+
+size_t telemetry_encode_json(const Sample_t* sample, int rssi, uint8_t fields, char* buf, size_t size);
+size_t telemetry_encode_binary(const Sample_t* sample, int rssi, uint8_t fields, uint8_t* buf, size_t size);
+size_t telemetry_encode_json_stream(const Sample_t* sample, int rssi, uint8_t fields, uint32_t dseq, uint8_t flags, char* buf, size_t size);
+size_t telemetry_encode_binary_stream(const Sample_t* sample, int rssi, uint8_t fields, uint32_t dseq, uint8_t flags, uint8_t* buf, size_t size);
+
+void telemetry_delta_init(TelemetryDelta_t* d);
+uint8_t telemetry_delta_select(TelemetryDelta_t* d, const SensorData_t* data, int rssi, uint8_t fields, bool* keyframe);
+
+#ifdef CONFIG_TELEMETRY_PROFILE
+void telemetry_profile_json(const Sample_t* sample, int rssi);
+#endif
+
+#endif // _TELEMETRY_H_
@@ -0,0 +1,32 @@
+/*
+    udp_telemetry.h
+    Optional datagram channel for telemetry, next to the TCP server.
+    Every datagram is one telemetry message stamped with a sequence number
+    and the device time. Datagrams are sent without blocking; one the stack
+    cannot take immediately is dropped, so a late sample never holds back a
+    newer one. Commands stay on TCP.
+*/
+
+#ifndef _UDP_TELEMETRY_H_
+#define _UDP_TELEMETRY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <lwip/sockets.h>
+#include "sdkconfig.h"
+#include "TCPServer.h"
+#include "sample_ring.h"
+
+typedef struct
+{
+    uint32_t sent;    // Datagrams handed to the stack
+    uint32_t dropped; // Datagrams dropped because the stack had no room
+} UdpTelemetryStats_t;
+
+bool udp_telemetry_init(void);
+bool udp_telemetry_send(const struct sockaddr_in* dest, const void* frame, size_t len);
+void udp_telemetry_multicast(const Sample_t* sample, int rssi);
+void udp_telemetry_stats(UdpTelemetryStats_t* out);
+
+#endif // _UDP_TELEMETRY_H_
@@ -0,0 +1,26 @@
+/*
+    ws_server.h
+    WebSocket endpoint for browser dashboards, served by esp_http_server.
+    Clients connect to ws://<device>:CONFIG_WS_SERVER_PORT/ws, receive the
+    same full-rate telemetry frames as TCP clients (text frames for JSON,
+    binary frames after a binary Hello) and send the same JSON messages.
+*/
+
+#ifndef _WS_SERVER_H_
+#define _WS_SERVER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "telemetry.h"
+
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+void Init_WsServer(void);
+uint8_t ws_server_encodings(void);
+void ws_server_broadcast(TelemetryEncoding encoding, const void* frame, size_t len);
+uint32_t ws_server_frames_dropped(void);
+bool ws_server_send(int fd, const void* msg, size_t len);
+#endif
+
+#endif // _WS_SERVER_H_
@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <string.h>
+#include "msg_framer.h"
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#else
+#define ESP_LOGW(tag, fmt, ...) ((void)0)
+#endif
+
+/**
+ * @brief Reset a framer to the empty state
+ * @param f Framer
+ * @retval None
+ */
+void msg_framer_init(MsgFramer_t* f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+/**
+ * @brief Get the free part of the reassembly buffer to receive into
+ * @param f Framer
+ * @param space Number of free bytes, never 0
+ * @retval Write position
+ */
+char* msg_framer_buffer(MsgFramer_t* f, size_t* space)
+{
+    *space = sizeof(f->buf) - f->len;
+    return f->buf + f->len;
+}
+
+/**
+ * @brief Account for n received bytes and dispatch every message they complete
+ * @param f Framer
+ * @param n Bytes written at the position returned by msg_framer_buffer
+ * @param handler Called once per complete message, in order
+ * @param ctx User context passed to the handler
+ * @retval Number of messages dispatched
+ */
+unsigned msg_framer_commit(MsgFramer_t* f, size_t n, MsgHandler handler, void* ctx)
+{
+    unsigned count = 0;
+    f->len += n;
+    f->partial = false;
+
+    for (; f->scan < f->len; f->scan++)
+    {
+        char ch = f->buf[f->scan];
+        if (f->discard > 0)
+        {
+            // Rest of an oversized binary message
+            // 超长二进制消息的剩余部分
+            size_t n = f->len - f->scan;
+            if (n > f->discard)
+                n = f->discard;
+            f->discard -= n;
+            f->scan += n - 1;
+            continue;
+        }
+        if (f->depth == 0)
+        {
+            if ((uint8_t)ch == MSG_BIN_MAGIC)
+            {
+                // Binary command, its length is in the header
+                // 二进制命令, 长度在帧头中
+                size_t avail = f->len - f->scan;
+                size_t total = (avail >= 2) ? MSG_BIN_HEADER_LEN + (uint8_t)f->buf[f->scan + 1] : 0;
+                f->junk = false;
+                if (total > sizeof(f->buf))
+                {
+                    // Cannot be buffered, drop it whole so the next message is found
+                    // 无法缓存, 整条丢弃以便找到下一条消息
+                    ESP_LOGW("TCP_Server", "Binary message of %u bytes longer than %u bytes, dropped",
+                        (unsigned)total, (unsigned)sizeof(f->buf));
+                    f->dropped++;
+                    f->discard = total - 1;
+                    continue;
+                }
+                f->start = f->scan;
+                if (total == 0 || avail < total)
+                {
+                    f->partial = true;
+                    break;
+                }
+                handler(f->buf + f->scan, total, ctx);
+                count++;
+                f->scan += total - 1;
+            }
+            else if (ch == '{')
+            {
+                f->start = f->scan;
+                f->depth = 1;
+                f->in_str = f->esc = f->junk = false;
+            }
+            else if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n')
+            {
+                // Not the start of a message, drop only this byte so a binary
+                // message right behind it is still found. A run counts once.
+                // 不是消息的开头, 只丢弃该字节, 以免丢掉紧随其后的二进制消息. 连续的无效字节只计一次.
+                if (!f->junk)
+                    f->dropped++;
+                f->junk = true;
+            }
+            continue;
+        }
+        if (f->in_str)
+        {
+            if (f->esc)
+                f->esc = false;
+            else if (ch == '\\')
+                f->esc = true;
+            else if (ch == '"')
+                f->in_str = false;
+            continue;
+        }
+        if (ch == '"')
+            f->in_str = true;
+        else if (ch == '{' || ch == '[')
+            f->depth++;
+        else if ((ch == '}' || ch == ']') && --f->depth == 0)
+        {
+            // The end of an oversized message is only a resync point
+            // 超长消息的结尾只作为重新同步点
+            if (f->oversized)
+                f->oversized = false;
+            else
+            {
+                handler(f->buf + f->start, f->scan - f->start + 1, ctx);
+                count++;
+            }
+        }
+    }
+
+    // Keep only the incomplete message, once per call rather than once per message.
+    // An incomplete binary message is scanned again from its start, nothing of
+    // an oversized one is kept.
+    // 只保留未完成的消息, 每次调用整理一次而非每条消息一次. 未完成的二进制消息从头重新扫描, 超长消息不保留.
+    if ((f->depth == 0 && !f->partial) || f->oversized)
+        f->len = f->scan = 0;
+    else if (f->start > 0)
+    {
+        f->len -= f->start;
+        memmove(f->buf, f->buf + f->start, f->len);
+        f->scan -= f->start;
+        f->start = 0;
+    }
+
+    // Only a JSON message can fill the buffer. Its bytes are dropped but its
+    // nesting and string state is still tracked, so the next message is found
+    // right after its end, delimiter or not.
+    // 只有JSON消息会填满缓冲区. 丢弃其字节但继续跟踪嵌套与字符串状态, 无论有无分隔符都能在其结尾之后找到下一条消息.
+    if (f->len == sizeof(f->buf))
+    {
+        ESP_LOGW("TCP_Server", "Client message longer than %u bytes, dropped", (unsigned)sizeof(f->buf));
+        f->len = f->scan = 0;
+        f->dropped++;
+        f->oversized = true;
+    }
+    return count;
+}
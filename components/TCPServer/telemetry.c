@@ -0,0 +1,592 @@
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "telemetry.h"
+
+#ifdef CONFIG_TELEMETRY_PROFILE
+#include "cJSON.h"
+#include "esp_cpu.h"
+#endif
+
+typedef struct
+{
+    char* p;
+    char* end;
+    bool ok;
+} JsonWriter_t;
+
+static void put_raw(JsonWriter_t* w, const char* s, size_t len)
+{
+    if (!w->ok || (size_t)(w->end - w->p) < len)
+    {
+        w->ok = false;
+        return;
+    }
+    memcpy(w->p, s, len);
+    w->p += len;
+}
+
+#define PUT_LIT(w, lit) put_raw((w), (lit), sizeof(lit) - 1)
+
+/**
+ * @brief Format a signed integer, faster than printf for the common whole-number case
+ * @param out Output buffer of at least 12 bytes
+ * @param v Value
+ * @retval Number of characters written
+ */
+static size_t format_int(char* out, int v)
+{
+    char tmp[12];
+    size_t n = 0, len = 0;
+    unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+    do
+    {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        out[len++] = '-';
+    while (n)
+        out[len++] = tmp[--n];
+    return len;
+}
+
+/**
+ * @brief Format an unsigned 64-bit integer such as a timestamp
+ * @param out Output buffer of at least 20 bytes
+ * @param v Value
+ * @retval Number of characters written
+ */
+static size_t format_u64(char* out, uint64_t v)
+{
+    char tmp[20];
+    size_t n = 0, len = 0;
+    do
+    {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n)
+        out[len++] = tmp[--n];
+    return len;
+}
+
+/**
+ * @brief Write a number exactly as cJSON_PrintUnformatted does
+ * @param w Writer
+ * @param d Value
+ * @retval None
+ * @note Whole numbers are printed as integers, anything else with "%1.15g" unless
+ *       that does not read back to the same double, in which case "%1.17g" is used.
+ *       Matching this rule keeps the output byte-identical for existing clients.
+ */
+static void put_number(JsonWriter_t* w, double d)
+{
+    char num[32];
+    size_t len;
+    if (isnan(d) || isinf(d))
+    {
+        PUT_LIT(w, "null");
+        return;
+    }
+
+    // Same saturation cJSON applies to valueint
+    // 与cJSON中valueint的饱和处理一致
+    int i = (d >= INT_MAX) ? INT_MAX : (d <= (double)INT_MIN) ? INT_MIN : (int)d;
+    if (d == (double)i)
+        len = format_int(num, i);
+    else
+    {
+        len = snprintf(num, sizeof(num), "%1.15g", d);
+        double test = strtod(num, NULL);
+        double max = fabs(test) > fabs(d) ? fabs(test) : fabs(d);
+        if (!(fabs(test - d) <= max * DBL_EPSILON))
+            len = snprintf(num, sizeof(num), "%1.17g", d);
+    }
+    put_raw(w, num, len);
+}
+
+// Indexed by bit position of TelemetryField
+// 按TelemetryField的位序号索引
+const char* const telemetry_field_names[TELEMETRY_FIELD_COUNT] = {
+    "WifiSignalStrength", "Voltage", "Temperature", "euler", "Motor", "Amps",
+};
+
+/**
+ * @brief Look up a field by its JSON key
+ * @param name JSON key as listed in telemetry_field_names
+ * @retval TelemetryField bit, 0 if the name is unknown
+ */
+uint8_t telemetry_field_from_name(const char* name)
+{
+    for (uint8_t i = 0;i < TELEMETRY_FIELD_COUNT;i++)
+        if (strcmp(name, telemetry_field_names[i]) == 0)
+            return 1 << i;
+    return 0;
+}
+
+/**
+ * @brief Write the key of the next member of the data object
+ * @param w Writer
+ * @param first Whether a member was written already, updated
+ * @param key Quoted key followed by a colon
+ * @param len Length of key
+ * @retval None
+ */
+static void put_key(JsonWriter_t* w, bool* first, const char* key, size_t len)
+{
+    if (!*first)
+        PUT_LIT(w, ",");
+    *first = false;
+    put_raw(w, key, len);
+}
+
+#define PUT_KEY(w, first, lit) put_key((w), (first), (lit), sizeof(lit) - 1)
+
+/**
+ * @brief Write the members of the data object selected by a field mask
+ * @param w Writer
+ * @param data Sensor sample
+ * @param rssi WiFi signal strength
+ * @param fields TelemetryField mask of the members to include, in their usual order
+ * @retval None
+ */
+static void put_fields_json(JsonWriter_t* w, const SensorData_t* data, int rssi, uint8_t fields)
+{
+    bool first = true;
+
+    if (fields & TELEMETRY_FIELD_RSSI)
+    {
+        PUT_KEY(w, &first, "\"WifiSignalStrength\":");
+        put_number(w, rssi);
+    }
+    if (fields & TELEMETRY_FIELD_VOLTAGE)
+    {
+        PUT_KEY(w, &first, "\"Voltage\":");
+        put_number(w, data->Voltage);
+    }
+    if (fields & TELEMETRY_FIELD_TEMPERATURE)
+    {
+        PUT_KEY(w, &first, "\"Temperature\":");
+        put_number(w, data->Temperature);
+    }
+    if (fields & TELEMETRY_FIELD_EULER)
+    {
+        PUT_KEY(w, &first, "\"euler\":{\"pitch\":");
+        put_number(w, data->euler.pitch);
+        PUT_LIT(w, ",\"roll\":");
+        put_number(w, data->euler.roll);
+        PUT_LIT(w, ",\"yaw\":");
+        put_number(w, data->euler.yaw);
+        PUT_LIT(w, "}");
+    }
+    if (fields & TELEMETRY_FIELD_MOTOR)
+    {
+        PUT_KEY(w, &first, "\"Motor\":[");
+        for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+        {
+            if (i)
+                PUT_LIT(w, ",");
+            PUT_LIT(w, "{\"Speed\":");
+            put_number(w, data->Motor[i].Speed);
+            if (data->Motor[i].Direction == CW)
+                PUT_LIT(w, ",\"Direction\":\"CW\"}");
+            else
+                PUT_LIT(w, ",\"Direction\":\"CCW\"}");
+        }
+        PUT_LIT(w, "]");
+    }
+    if (fields & TELEMETRY_FIELD_AMPS)
+    {
+        PUT_KEY(w, &first, "\"Amps\":");
+        put_number(w, data->Amps);
+    }
+}
+
+/**
+ * @brief Open a message and write its type, sample number and timestamp
+ * @param w Writer
+ * @param type Quoted message type
+ * @param len Length of type
+ * @param sample Sample the message carries
+ * @retval None
+ */
+static void put_head_json(JsonWriter_t* w, const char* type, size_t len, const Sample_t* sample)
+{
+    char num[20];
+
+    PUT_LIT(w, "{\"type\":");
+    put_raw(w, type, len);
+    PUT_LIT(w, ",\"seq\":");
+    put_raw(w, num, format_u64(num, sample->seq));
+    PUT_LIT(w, ",\"ts\":");
+    put_raw(w, num, format_u64(num, (uint64_t)sample->timestamp));
+}
+
+/**
+ * @brief Encode a sample as the JSON telemetry message without any allocation
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength to report
+ * @param fields TelemetryField mask of the members to include, in their usual order
+ * @param buf Output buffer, TELEMETRY_JSON_MAX_LEN bytes are always enough
+ * @param size Size of the output buffer
+ * @retval Length of the message (not NUL terminated), 0 if buf is too small
+ */
+size_t telemetry_encode_json(const Sample_t* sample, int rssi, uint8_t fields, char* buf, size_t size)
+{
+    JsonWriter_t w = { buf, buf + size, true };
+
+    put_head_json(&w, "\"data\"", 6, sample);
+    PUT_LIT(&w, ",\"data\":{");
+    put_fields_json(&w, &sample->data, rssi, fields);
+    PUT_LIT(&w, "}}");
+
+    return w.ok ? (size_t)(w.p - buf) : 0;
+}
+
+/**
+ * @brief Encode a message of a stream with its own sequence number, a delta stream or datagrams
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength to report
+ * @param fields TelemetryField mask, from telemetry_delta_select in delta mode
+ * @param dseq Sequence number of the message within its stream
+ * @param flags TELEMETRY_FLAG_DELTA for a delta, TELEMETRY_FLAG_KEYFRAME for a keyframe
+ * @param buf Output buffer, TELEMETRY_JSON_MAX_LEN bytes are always enough
+ * @param size Size of the output buffer
+ * @retval Length of the message (not NUL terminated), 0 if buf is too small
+ */
+size_t telemetry_encode_json_stream(const Sample_t* sample, int rssi, uint8_t fields, uint32_t dseq, uint8_t flags, char* buf, size_t size)
+{
+    JsonWriter_t w = { buf, buf + size, true };
+    char num[20];
+
+    if (flags & TELEMETRY_FLAG_DELTA)
+        put_head_json(&w, "\"delta\"", 7, sample);
+    else
+        put_head_json(&w, "\"data\"", 6, sample);
+    PUT_LIT(&w, ",\"dseq\":");
+    put_raw(&w, num, format_u64(num, dseq));
+    if (flags & TELEMETRY_FLAG_KEYFRAME)
+        PUT_LIT(&w, ",\"keyframe\":true");
+    PUT_LIT(&w, ",\"data\":{");
+    put_fields_json(&w, &sample->data, rssi, fields);
+    PUT_LIT(&w, "}}");
+
+    return w.ok ? (size_t)(w.p - buf) : 0;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v)
+{
+    for (uint8_t i = 0;i < 4;i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+    return p + 4;
+}
+
+static uint8_t* put_f32(uint8_t* p, float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    p[0] = (uint8_t)u;
+    p[1] = (uint8_t)(u >> 8);
+    p[2] = (uint8_t)(u >> 16);
+    p[3] = (uint8_t)(u >> 24);
+    return p + 4;
+}
+
+static uint8_t clamp_rssi(int rssi)
+{
+    return (uint8_t)(int8_t)(rssi < INT8_MIN ? INT8_MIN : rssi > INT8_MAX ? INT8_MAX : rssi);
+}
+
+/**
+ * @brief Write the selected fields in schema 5 order
+ * @param p Output position
+ * @param data Sensor sample
+ * @param rssi WiFi signal strength
+ * @param fields TelemetryField mask
+ * @retval Position after the last field
+ */
+static uint8_t* put_fields_bin(uint8_t* p, const SensorData_t* data, int rssi, uint8_t fields)
+{
+    if (fields & TELEMETRY_FIELD_RSSI)
+        *p++ = clamp_rssi(rssi);
+    if (fields & TELEMETRY_FIELD_VOLTAGE)
+        p = put_f32(p, data->Voltage);
+    if (fields & TELEMETRY_FIELD_TEMPERATURE)
+        p = put_f32(p, data->Temperature);
+    if (fields & TELEMETRY_FIELD_EULER)
+    {
+        p = put_f32(p, data->euler.roll);
+        p = put_f32(p, data->euler.pitch);
+        p = put_f32(p, data->euler.yaw);
+    }
+    if (fields & TELEMETRY_FIELD_MOTOR)
+        for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+        {
+            p = put_f32(p, data->Motor[i].Speed);
+            *p++ = (uint8_t)data->Motor[i].Direction;
+        }
+    if (fields & TELEMETRY_FIELD_AMPS)
+        p = put_f32(p, data->Amps);
+    return p;
+}
+
+/**
+ * @brief Write the frame header and the sample number and timestamp every payload starts with
+ * @param buf Frame buffer
+ * @param schema Schema of the payload
+ * @param sample Sample the frame carries
+ * @retval Position after the stamp
+ */
+static uint8_t* put_head_bin(uint8_t* buf, uint8_t schema, const Sample_t* sample)
+{
+    buf[0] = TELEMETRY_BIN_MAGIC;
+    buf[1] = schema;
+    uint8_t* p = put_u32(buf + TELEMETRY_BIN_HEADER_LEN, sample->seq);
+    p = put_u32(p, (uint32_t)sample->timestamp);
+    return put_u32(p, (uint32_t)((uint64_t)sample->timestamp >> 32));
+}
+
+/**
+ * @brief Fill in the payload length once the payload is written
+ * @param buf Frame buffer
+ * @param end Position after the payload
+ * @retval Frame length
+ */
+static size_t end_bin(uint8_t* buf, const uint8_t* end)
+{
+    size_t len = end - buf - TELEMETRY_BIN_HEADER_LEN;
+    buf[2] = (uint8_t)len;
+    buf[3] = (uint8_t)(len >> 8);
+    return TELEMETRY_BIN_HEADER_LEN + len;
+}
+
+/**
+ * @brief Encode a sample as a binary telemetry frame
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength to report
+ * @param fields TelemetryField mask, all fields give a schema 5 frame, anything else schema 6
+ * @param buf Output buffer, TELEMETRY_BIN_MAX_LEN bytes are always enough
+ * @param size Size of the output buffer
+ * @retval Frame length, 0 if buf is too small
+ */
+size_t telemetry_encode_binary(const Sample_t* sample, int rssi, uint8_t fields, uint8_t* buf, size_t size)
+{
+    if (size < TELEMETRY_BIN_MAX_LEN)
+        return 0;
+
+    uint8_t* p;
+    if ((fields & TELEMETRY_FIELDS_ALL) == TELEMETRY_FIELDS_ALL)
+    {
+        p = put_head_bin(buf, TELEMETRY_BIN_SCHEMA, sample);
+        *p++ = clamp_rssi(rssi);
+        p += uart_frame_pack_sensor(&sample->data, p, size - (p - buf));
+        return end_bin(buf, p);
+    }
+
+    p = put_head_bin(buf, TELEMETRY_BIN_SCHEMA_FIELDS, sample);
+    *p++ = fields & TELEMETRY_FIELDS_ALL;
+    return end_bin(buf, put_fields_bin(p, &sample->data, rssi, fields));
+}
+
+/**
+ * @brief Encode a frame of a stream with its own sequence number, a delta stream or datagrams (schema 7)
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength to report
+ * @param fields TelemetryField mask, from telemetry_delta_select in delta mode
+ * @param dseq Sequence number of the frame within its stream
+ * @param flags TELEMETRY_FLAG_* bits
+ * @param buf Output buffer, TELEMETRY_BIN_MAX_LEN bytes are always enough
+ * @param size Size of the output buffer
+ * @retval Frame length, 0 if buf is too small
+ */
+size_t telemetry_encode_binary_stream(const Sample_t* sample, int rssi, uint8_t fields, uint32_t dseq, uint8_t flags, uint8_t* buf, size_t size)
+{
+    if (size < TELEMETRY_BIN_MAX_LEN)
+        return 0;
+
+    uint8_t* p = put_head_bin(buf, TELEMETRY_BIN_SCHEMA_STREAM, sample);
+    p = put_u32(p, dseq);
+    *p++ = flags;
+    *p++ = fields & TELEMETRY_FIELDS_ALL;
+    return end_bin(buf, put_fields_bin(p, &sample->data, rssi, fields));
+}
+
+// Deadbands from Kconfig, indexed by bit position of TelemetryField
+// 来自Kconfig的死区, 按TelemetryField的位序号索引
+static const float default_deadband[TELEMETRY_FIELD_COUNT] = {
+    CONFIG_TELEMETRY_DEADBAND_RSSI,
+    CONFIG_TELEMETRY_DEADBAND_VOLTAGE_MV / 1000.0f,
+    CONFIG_TELEMETRY_DEADBAND_TEMPERATURE_CENTI / 100.0f,
+    CONFIG_TELEMETRY_DEADBAND_EULER_CENTI / 100.0f,
+    CONFIG_TELEMETRY_DEADBAND_SPEED_CENTI / 100.0f,
+    CONFIG_TELEMETRY_DEADBAND_AMPS_MA / 1000.0f,
+};
+
+/**
+ * @brief Reset delta state so the next frame is a keyframe, with the Kconfig deadbands
+ * @param d Delta state
+ * @retval None
+ */
+void telemetry_delta_init(TelemetryDelta_t* d)
+{
+    memset(d, 0, sizeof(*d));
+    memcpy(d->deadband, default_deadband, sizeof(d->deadband));
+    d->key_due = true;
+}
+
+static bool moved(float ref, float now, float deadband)
+{
+    // NaN never compares, so a NaN appearing or clearing counts as a change
+    // NaN无法比较, 因此NaN的出现或消失都视为变化
+    if (isnan(ref) || isnan(now))
+        return isnan(ref) != isnan(now);
+    return fabsf(now - ref) > deadband;
+}
+
+/**
+ * @brief Choose the fields of the next frame of a client in delta mode
+ * @param d Delta state, its reference is updated with the returned fields
+ * @param data Sensor sample
+ * @param rssi WiFi signal strength
+ * @param fields Subscribed TelemetryField mask
+ * @param keyframe Set when the frame has to be a keyframe
+ * @retval Fields to send, 0 if nothing moved beyond its deadband
+ * @note A keyframe is sent when one was requested with key_due and otherwise every
+ *       CONFIG_TELEMETRY_KEYFRAME_INTERVAL samples. In between a field is sent when it
+ *       moved beyond its deadband since it was last sent, so slow drift is not lost.
+ */
+uint8_t telemetry_delta_select(TelemetryDelta_t* d, const SensorData_t* data, int rssi, uint8_t fields, bool* keyframe)
+{
+    const SensorData_t* ref = &d->ref;
+    uint8_t changed = 0;
+
+    *keyframe = d->key_due || ++d->since_key >= CONFIG_TELEMETRY_KEYFRAME_INTERVAL;
+    if (*keyframe)
+    {
+        changed = fields;
+        d->key_due = false;
+        d->since_key = 0;
+    }
+    else
+    {
+        if (abs(rssi - d->ref_rssi) > d->deadband[0])
+            changed |= TELEMETRY_FIELD_RSSI;
+        if (moved(ref->Voltage, data->Voltage, d->deadband[1]))
+            changed |= TELEMETRY_FIELD_VOLTAGE;
+        if (moved(ref->Temperature, data->Temperature, d->deadband[2]))
+            changed |= TELEMETRY_FIELD_TEMPERATURE;
+        if (moved(ref->euler.roll, data->euler.roll, d->deadband[3])
+            || moved(ref->euler.pitch, data->euler.pitch, d->deadband[3])
+            || moved(ref->euler.yaw, data->euler.yaw, d->deadband[3]))
+            changed |= TELEMETRY_FIELD_EULER;
+        for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+            if (ref->Motor[i].Direction != data->Motor[i].Direction
+                || moved(ref->Motor[i].Speed, data->Motor[i].Speed, d->deadband[4]))
+                changed |= TELEMETRY_FIELD_MOTOR;
+        if (moved(ref->Amps, data->Amps, d->deadband[5]))
+            changed |= TELEMETRY_FIELD_AMPS;
+        changed &= fields;
+    }
+
+    if (changed & TELEMETRY_FIELD_RSSI)
+        d->ref_rssi = rssi;
+    if (changed & TELEMETRY_FIELD_VOLTAGE)
+        d->ref.Voltage = data->Voltage;
+    if (changed & TELEMETRY_FIELD_TEMPERATURE)
+        d->ref.Temperature = data->Temperature;
+    if (changed & TELEMETRY_FIELD_EULER)
+        d->ref.euler = data->euler;
+    if (changed & TELEMETRY_FIELD_MOTOR)
+        memcpy(d->ref.Motor, data->Motor, sizeof(d->ref.Motor));
+    if (changed & TELEMETRY_FIELD_AMPS)
+        d->ref.Amps = data->Amps;
+    return changed;
+}
+
+#ifdef CONFIG_TELEMETRY_PROFILE
+/**
+ * @brief Build the message with a cJSON tree, the way Process_Data used to
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength
+ * @retval Heap string from cJSON_PrintUnformatted, NULL on failure
+ */
+static char* encode_json_cjson(const Sample_t* sample, int rssi)
+{
+    const SensorData_t* data = &sample->data;
+    cJSON* root = cJSON_CreateObject();
+    if (root == NULL)
+        return NULL;
+    cJSON_AddStringToObject(root, "type", "data");
+    cJSON_AddNumberToObject(root, "seq", sample->seq);
+    cJSON_AddNumberToObject(root, "ts", sample->timestamp);
+    cJSON* data_obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(data_obj, "WifiSignalStrength", rssi);
+    cJSON_AddNumberToObject(data_obj, "Voltage", data->Voltage);
+    cJSON_AddNumberToObject(data_obj, "Temperature", data->Temperature);
+    cJSON* euler = cJSON_CreateObject();
+    cJSON_AddNumberToObject(euler, "pitch", data->euler.pitch);
+    cJSON_AddNumberToObject(euler, "roll", data->euler.roll);
+    cJSON_AddNumberToObject(euler, "yaw", data->euler.yaw);
+    cJSON_AddItemToObject(data_obj, "euler", euler);
+    cJSON* motors = cJSON_CreateArray();
+    for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+    {
+        cJSON* motor = cJSON_CreateObject();
+        cJSON_AddNumberToObject(motor, "Speed", data->Motor[i].Speed);
+        cJSON_AddStringToObject(motor, "Direction", (data->Motor[i].Direction == CW) ? "CW" : "CCW");
+        cJSON_AddItemToArray(motors, motor);
+    }
+    cJSON_AddItemToObject(data_obj, "Motor", motors);
+    cJSON_AddNumberToObject(data_obj, "Amps", data->Amps);
+    cJSON_AddItemToObject(root, "data", data_obj);
+
+    char* json_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json_str;
+}
+
+/**
+ * @brief Compare the encoder with the cJSON implementation on a live sample
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength
+ * @retval None
+ * @note Logs average cycles per sample of both encoders every 100 samples
+ */
+void telemetry_profile_json(const Sample_t* sample, int rssi)
+{
+    static char buf[TELEMETRY_JSON_MAX_LEN];
+    static uint64_t cycles_new = 0, cycles_ref = 0;
+    static uint32_t samples = 0, mismatches = 0;
+
+    uint32_t t0 = esp_cpu_get_cycle_count();
+    size_t len = telemetry_encode_json(sample, rssi, TELEMETRY_FIELDS_ALL, buf, sizeof(buf));
+    uint32_t t1 = esp_cpu_get_cycle_count();
+    char* ref = encode_json_cjson(sample, rssi);
+    uint32_t t2 = esp_cpu_get_cycle_count();
+
+    if (ref == NULL || strlen(ref) != len || memcmp(ref, buf, len) != 0)
+    {
+        mismatches++;
+        ESP_LOGW("Telemetry", "Encoder output differs from cJSON: %.*s", (int)len, buf);
+    }
+    free(ref);
+
+    cycles_new += t1 - t0;
+    cycles_ref += t2 - t1;
+    if (++samples == 100)
+    {
+        ESP_LOGI("Telemetry", "JSON encode: %u cycles/sample, cJSON: %u cycles/sample, %u mismatches",
+            (unsigned)(cycles_new / samples), (unsigned)(cycles_ref / samples), (unsigned)mismatches);
+        cycles_new = cycles_ref = 0;
+        samples = mismatches = 0;
+    }
+}
+#endif
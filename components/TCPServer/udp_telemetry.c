@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "telemetry.h"
+#include "udp_telemetry.h"
+
+static int udp_sock = -1;
+static UdpTelemetryStats_t udp_stats;
+
+#ifdef CONFIG_TELEMETRY_UDP_MULTICAST
+static struct sockaddr_in multicast_dest;
+static uint32_t multicast_seq = 0;
+#endif
+
+/**
+ * @brief Create the datagram socket and, if enabled, set up the multicast group
+ * @retval true on success
+ */
+bool udp_telemetry_init(void)
+{
+    if (udp_sock >= 0)
+        return true;
+
+    udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (udp_sock < 0)
+    {
+        ESP_LOGE("Telemetry", "Unable to create UDP socket: errno %d", errno);
+        return false;
+    }
+
+#ifdef CONFIG_TELEMETRY_UDP_MULTICAST
+    uint8_t ttl = CONFIG_TELEMETRY_UDP_MULTICAST_TTL;
+    setsockopt(udp_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    memset(&multicast_dest, 0, sizeof(multicast_dest));
+    multicast_dest.sin_family = AF_INET;
+    multicast_dest.sin_port = htons(CONFIG_TELEMETRY_UDP_MULTICAST_PORT);
+    if (inet_aton(CONFIG_TELEMETRY_UDP_MULTICAST_GROUP, &multicast_dest.sin_addr) == 0)
+    {
+        ESP_LOGE("Telemetry", "Invalid multicast group %s", CONFIG_TELEMETRY_UDP_MULTICAST_GROUP);
+        close(udp_sock);
+        udp_sock = -1;
+        return false;
+    }
+    ESP_LOGI("Telemetry", "UDP telemetry multicast to %s:%d", CONFIG_TELEMETRY_UDP_MULTICAST_GROUP, CONFIG_TELEMETRY_UDP_MULTICAST_PORT);
+#endif
+    return true;
+}
+
+/**
+ * @brief Send one telemetry datagram without blocking
+ * @param dest Destination address
+ * @param frame Encoded, stamped telemetry message
+ * @param len Message length
+ * @retval true if the stack accepted the datagram, false if it was dropped
+ */
+bool udp_telemetry_send(const struct sockaddr_in* dest, const void* frame, size_t len)
+{
+    if (udp_sock < 0)
+        return false;
+
+    int sent = sendto(udp_sock, frame, len, MSG_DONTWAIT, (const struct sockaddr*)dest, sizeof(*dest));
+    if (sent < 0)
+    {
+        // Out of buffers means the link is behind, the sample is stale by the time it could go
+        // 缓冲区耗尽说明链路落后, 等到能发送时样本已经过时
+        udp_stats.dropped++;
+        ESP_LOGD("Telemetry", "UDP datagram dropped: errno %d", errno);
+        return false;
+    }
+    udp_stats.sent++;
+    return true;
+}
+
+/**
+ * @brief Send a sample to the multicast group, all fields at full rate
+ * @param sample Stamped sensor sample
+ * @param rssi WiFi signal strength to report
+ * @retval None
+ * @note Does nothing unless CONFIG_TELEMETRY_UDP_MULTICAST is set
+ */
+void udp_telemetry_multicast(const Sample_t* sample, int rssi)
+{
+#ifdef CONFIG_TELEMETRY_UDP_MULTICAST
+    static uint8_t buf[TELEMETRY_JSON_MAX_LEN];
+    size_t len;
+#ifdef CONFIG_TELEMETRY_UDP_MULTICAST_BINARY
+    len = telemetry_encode_binary_stream(sample, rssi, TELEMETRY_FIELDS_ALL, multicast_seq++, 0, buf, sizeof(buf));
+#else
+    len = telemetry_encode_json_stream(sample, rssi, TELEMETRY_FIELDS_ALL, multicast_seq++, 0, (char*)buf, sizeof(buf));
+#endif
+    if (len)
+        udp_telemetry_send(&multicast_dest, buf, len);
+#endif
+}
+
+/**
+ * @brief Get the datagram counters
+ * @param out Destination
+ * @retval None
+ */
+void udp_telemetry_stats(UdpTelemetryStats_t* out)
+{
+    *out = udp_stats;
+}
@@ -0,0 +1,368 @@
+#include "sdkconfig.h"
+
+#ifdef CONFIG_TELEMETRY_WEBSOCKET
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lwip/sockets.h>
+
+#include "cJSON.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "TCPServer.h"
+#include "ws_server.h"
+
+// TCP listen socket, UDP socket, httpd listen and control sockets
+// TCP监听套接字, UDP套接字, httpd监听与控制套接字
+_Static_assert(CONFIG_MAX_CLIENTS + CONFIG_WS_MAX_CLIENTS + 4 <= CONFIG_LWIP_MAX_SOCKETS,
+    "CONFIG_LWIP_MAX_SOCKETS too small for CONFIG_MAX_CLIENTS plus CONFIG_WS_MAX_CLIENTS");
+
+typedef struct
+{
+    int fd;
+    TelemetryEncoding encoding;
+} WsClient_t;
+
+// A frame waiting for the httpd task to send it to every WebSocket client
+// 等待httpd任务发送给所有WebSocket客户端的帧
+typedef struct
+{
+    atomic_bool busy;
+    TelemetryEncoding encoding;
+    size_t len;
+    uint8_t buf[TELEMETRY_JSON_MAX_LEN];
+} WsFrameSlot_t;
+
+// A text message for one client, such as a command reply
+// 发给单个客户端的文本消息, 例如命令应答
+typedef struct
+{
+    int fd;
+    size_t len;
+    uint8_t buf[];
+} WsMessage_t;
+
+_Static_assert(TELEMETRY_JSON_MAX_LEN >= TELEMETRY_BIN_MAX_LEN, "WebSocket frame slot too small for a binary frame");
+
+static httpd_handle_t ws_server = NULL;
+static WsClient_t ws_clients[CONFIG_WS_MAX_CLIENTS];
+static volatile uint8_t ws_encodings = 0;
+static WsFrameSlot_t frame_slots[CONFIG_WS_FRAME_SLOTS];
+static uint32_t frames_dropped = 0;
+
+/**
+ * @brief Recompute which encodings WebSocket clients use
+ * @retval None
+ * @note Called from the httpd task, whenever the client table changes
+ */
+static void ws_update_encodings(void)
+{
+    uint8_t encodings = 0;
+    for (uint8_t i = 0;i < CONFIG_WS_MAX_CLIENTS;i++)
+        if (ws_clients[i].fd >= 0)
+            encodings |= 1 << ws_clients[i].encoding;
+    ws_encodings = encodings;
+}
+
+static WsClient_t* ws_find_client(int fd)
+{
+    for (uint8_t i = 0;i < CONFIG_WS_MAX_CLIENTS;i++)
+        if (ws_clients[i].fd == fd)
+            return &ws_clients[i];
+    return NULL;
+}
+
+/**
+ * @brief httpd close callback, forgets the client and closes its socket
+ * @param hd Server handle
+ * @param sockfd Socket being closed
+ * @retval None
+ */
+static void ws_close_fn(httpd_handle_t hd, int sockfd)
+{
+    WsClient_t* c = ws_find_client(sockfd);
+    if (c != NULL)
+    {
+        c->fd = -1;
+        Forget_Client_Commands(sockfd);
+        ws_update_encodings();
+        ESP_LOGI("TCP_Server", "WebSocket client %d disconnected", sockfd);
+    }
+    close(sockfd);
+}
+
+/**
+ * @brief Handle a Hello message of a WebSocket client
+ * @param req Request of the frame
+ * @param c Client
+ * @param root Parsed message
+ * @retval None
+ */
+static void ws_hello(httpd_req_t* req, WsClient_t* c, const cJSON* root)
+{
+    TelemetryEncoding encoding = TELEMETRY_JSON;
+    const cJSON* enc_item = cJSON_GetObjectItem(root, "Encoding");
+    if (cJSON_IsString(enc_item) && strcmp(enc_item->valuestring, "binary") == 0)
+        encoding = TELEMETRY_BINARY;
+
+    // Acknowledged from the httpd task, so it is always sent before the first frame of the new encoding
+    // 在httpd任务中应答, 因此总是先于新编码的第一帧发出
+    char ack[96];
+    int ack_len = snprintf(ack, sizeof(ack), "{\"type\":\"Hello\",\"Encoding\":\"%s\",\"Schema\":%d}",
+        encoding == TELEMETRY_BINARY ? "binary" : "json", TELEMETRY_BIN_SCHEMA);
+    httpd_ws_frame_t frame = {
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t*)ack,
+        .len = ack_len,
+    };
+    httpd_ws_send_frame(req, &frame);
+    c->encoding = encoding;
+    ws_update_encodings();
+}
+
+/**
+ * @brief URI handler of /ws: registers new clients and processes their messages
+ * @param req Request
+ * @retval ESP_OK, or an error to make httpd close the connection
+ */
+static esp_err_t ws_handler(httpd_req_t* req)
+{
+    static char rx_buf[CONFIG_CLIENT_RX_BUFFER_SIZE];
+    int fd = httpd_req_to_sockfd(req);
+
+    if (req->method == HTTP_GET)
+    {
+        // Handshake done, the connection is a WebSocket from now on
+        // 握手完成, 此后该连接为WebSocket
+        WsClient_t* c = ws_find_client(-1);
+        if (c == NULL)
+        {
+            ESP_LOGW("TCP_Server", "WebSocket client list full, dropping new client");
+            return ESP_FAIL;
+        }
+        c->fd = fd;
+        c->encoding = TELEMETRY_JSON;
+        ws_update_encodings();
+        ESP_LOGI("TCP_Server", "WebSocket client %d connected", fd);
+        return ESP_OK;
+    }
+
+    httpd_ws_frame_t frame = { 0 };
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ret != ESP_OK)
+        return ret;
+    if (frame.len > sizeof(rx_buf))
+    {
+        ESP_LOGW("TCP_Server", "WebSocket message of %u bytes too long", (unsigned)frame.len);
+        return ESP_FAIL;
+    }
+    frame.payload = (uint8_t*)rx_buf;
+    ret = httpd_ws_recv_frame(req, &frame, sizeof(rx_buf));
+    if (ret != ESP_OK)
+        return ret;
+    int64_t rx_at = esp_timer_get_time();
+    // A binary frame carries one binary command, in the same format as on TCP
+    // 二进制帧携带一条二进制命令, 格式与TCP相同
+    if (frame.type == HTTPD_WS_TYPE_BINARY)
+    {
+        Process_Client_Binary(fd, frame.payload, frame.len, rx_at);
+        return ESP_OK;
+    }
+    if (frame.type != HTTPD_WS_TYPE_TEXT)
+        return ESP_OK;
+    // An emergency stop is sent before anything is parsed
+    // 急停命令在解析之前发送
+    if (Process_EStop(fd, rx_buf, frame.len, rx_at))
+        return ESP_OK;
+
+    WsClient_t* c = ws_find_client(fd);
+    cJSON* root = cJSON_ParseWithLength(rx_buf, frame.len);
+    if (c == NULL || root == NULL)
+    {
+        ESP_LOGE("TCP_Server", "Invalid JSON input");
+        cJSON_Delete(root);
+        return ESP_OK;
+    }
+
+    const cJSON* type_item = cJSON_GetObjectItem(root, "type");
+    if (cJSON_IsString(type_item) && strcmp(type_item->valuestring, "Hello") == 0)
+        ws_hello(req, c, root);
+    else if (cJSON_IsString(type_item) && strcmp(type_item->valuestring, "Subscribe") == 0)
+        ESP_LOGW("TCP_Server", "Subscribe is not supported on WebSocket, client %d gets full-rate telemetry", fd);
+    else
+        Process_Client_Message(fd, root, rx_at);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+/**
+ * @brief httpd work item, sends one queued frame to every client of its encoding
+ * @param arg Frame slot
+ * @retval None
+ */
+static void ws_send_work(void* arg)
+{
+    WsFrameSlot_t* slot = arg;
+    httpd_ws_frame_t frame = {
+        .type = (slot->encoding == TELEMETRY_BINARY) ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT,
+        .payload = slot->buf,
+        .len = slot->len,
+    };
+    for (uint8_t i = 0;i < CONFIG_WS_MAX_CLIENTS;i++)
+    {
+        int fd = ws_clients[i].fd;
+        if (fd < 0 || ws_clients[i].encoding != slot->encoding)
+            continue;
+        if (httpd_ws_send_frame_async(ws_server, fd, &frame) != ESP_OK)
+        {
+            ESP_LOGE("TCP_Server", "Error sending to WebSocket client %d", fd);
+            httpd_sess_trigger_close(ws_server, fd);
+        }
+    }
+    atomic_store(&slot->busy, false);
+}
+
+/**
+ * @brief Encodings WebSocket clients currently use
+ * @retval Bit mask, bit n set for TelemetryEncoding n
+ */
+uint8_t ws_server_encodings(void)
+{
+    return ws_encodings;
+}
+
+/**
+ * @brief Queue an encoded frame for every WebSocket client of that encoding
+ * @param encoding Encoding of the frame
+ * @param frame Frame, copied once whatever the number of clients
+ * @param len Frame length
+ * @retval None
+ * @note Never blocks. If every slot is still being sent the frame is dropped, the
+ *       same way a TCP laggard loses frames rather than delaying the broadcaster.
+ */
+void ws_server_broadcast(TelemetryEncoding encoding, const void* frame, size_t len)
+{
+    if (ws_server == NULL || len > sizeof(frame_slots[0].buf))
+        return;
+
+    for (uint8_t i = 0;i < CONFIG_WS_FRAME_SLOTS;i++)
+    {
+        WsFrameSlot_t* slot = &frame_slots[i];
+        if (atomic_load(&slot->busy))
+            continue;
+        memcpy(slot->buf, frame, len);
+        slot->len = len;
+        slot->encoding = encoding;
+        atomic_store(&slot->busy, true);
+        if (httpd_queue_work(ws_server, ws_send_work, slot) != ESP_OK)
+        {
+            atomic_store(&slot->busy, false);
+            break;
+        }
+        return;
+    }
+    if (++frames_dropped % 100 == 1)
+        ESP_LOGW("TCP_Server", "WebSocket clients behind, %u frames dropped", (unsigned)frames_dropped);
+}
+
+/**
+ * @brief Frames dropped because every slot was still being sent
+ * @retval Frame count since boot
+ */
+uint32_t ws_server_frames_dropped(void)
+{
+    return frames_dropped;
+}
+
+/**
+ * @brief httpd work item, sends one queued message to its client
+ * @param arg Message, freed here
+ * @retval None
+ */
+static void ws_send_message_work(void* arg)
+{
+    WsMessage_t* msg = arg;
+    httpd_ws_frame_t frame = {
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = msg->buf,
+        .len = msg->len,
+    };
+    // The client may have left while the message was queued
+    // 消息排队期间客户端可能已断开
+    if (ws_find_client(msg->fd) != NULL && httpd_ws_send_frame_async(ws_server, msg->fd, &frame) != ESP_OK)
+    {
+        ESP_LOGE("TCP_Server", "Error sending to WebSocket client %d", msg->fd);
+        httpd_sess_trigger_close(ws_server, msg->fd);
+    }
+    free(msg);
+}
+
+/**
+ * @brief Queue a text message for one WebSocket client
+ * @param fd Client socket
+ * @param msg Message, copied
+ * @param len Message length
+ * @retval false if fd is not a WebSocket client or the message could not be queued
+ * @note Never blocks, callable from any task
+ */
+bool ws_server_send(int fd, const void* msg, size_t len)
+{
+    if (ws_server == NULL || ws_find_client(fd) == NULL)
+        return false;
+    WsMessage_t* m = malloc(sizeof(WsMessage_t) + len);
+    if (m == NULL)
+        return false;
+    m->fd = fd;
+    m->len = len;
+    memcpy(m->buf, msg, len);
+    if (httpd_queue_work(ws_server, ws_send_message_work, m) != ESP_OK)
+    {
+        free(m);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Start the HTTP server and register the /ws endpoint
+ * @retval None
+ */
+void Init_WsServer(void)
+{
+    if (ws_server != NULL)
+        return;
+
+    for (uint8_t i = 0;i < CONFIG_WS_MAX_CLIENTS;i++)
+        ws_clients[i].fd = -1;
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = CONFIG_WS_SERVER_PORT;
+    config.max_open_sockets = CONFIG_WS_MAX_CLIENTS;
+    config.close_fn = ws_close_fn;
+    // A stalled browser must not hold the httpd task, and with it every other client, for long
+    // 卡住的浏览器不应长时间占用httpd任务, 进而拖累其他客户端
+    config.send_wait_timeout = 1;
+
+    if (httpd_start(&ws_server, &config) != ESP_OK)
+    {
+        ESP_LOGE("TCP_Server", "Unable to start WebSocket server");
+        ws_server = NULL;
+        return;
+    }
+
+    httpd_uri_t ws_uri = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = ws_handler,
+        .user_ctx = NULL,
+        .is_websocket = true,
+    };
+    httpd_register_uri_handler(ws_server, &ws_uri);
+    ESP_LOGI("TCP_Server", "WebSocket endpoint on port %d at /ws", CONFIG_WS_SERVER_PORT);
+}
+
+#endif // CONFIG_TELEMETRY_WEBSOCKET
@@ -0,0 +1,68 @@
+/*
+    sample_ring.h
+    Statically allocated single-producer/single-consumer ring of Sample_t.
+    The UART task is the only producer and the telemetry task the only consumer,
+    so no lock is needed: head is written by the producer only, tail is advanced
+    with compare-and-swap because the drop-oldest/latest policies let the
+    producer evict the oldest sample while the consumer may be reading it.
+    This file has no ESP-IDF dependency so it can also be built on the host.
+*/
+
+#ifndef _SAMPLE_RING_H_
+#define _SAMPLE_RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#include "TCPServer.h"
+
+#define SAMPLE_RING_SIZE (CONFIG_SAMPLE_RING_SIZE)
+#define SAMPLE_RING_MASK (SAMPLE_RING_SIZE - 1)
+
+_Static_assert((SAMPLE_RING_SIZE & SAMPLE_RING_MASK) == 0, "CONFIG_SAMPLE_RING_SIZE must be a power of two");
+
+typedef enum
+{
+    SAMPLE_RING_DROP_OLDEST, // Full ring: the oldest sample is overwritten
+    SAMPLE_RING_LATEST,      // Like DROP_OLDEST, and the consumer always takes the newest sample
+    SAMPLE_RING_BLOCK,       // Full ring: reserve fails and the producer has to wait
+} SampleRingPolicy;
+
+// A decoded sensor sample together with when and in which order it arrived
+// 解码后的传感器样本, 附带其到达时间与顺序
+typedef struct
+{
+    SensorData_t data;
+    int64_t timestamp; // Monotonic device time in us at which the last byte of its UART frame arrived
+    uint32_t seq;      // Global sample number, counted by the producer before the ring
+} Sample_t;
+
+typedef struct
+{
+    uint32_t overwritten; // Samples evicted by the producer before being read
+    uint32_t skipped;     // Older samples skipped by the consumer in LATEST mode
+    uint32_t stalls;      // Times the producer found the ring full in BLOCK mode
+} SampleRingStats_t;
+
+typedef struct
+{
+    Sample_t slots[SAMPLE_RING_SIZE];
+    atomic_uint head; // Next slot to write, only advanced by the producer
+    atomic_uint tail; // Next slot to read
+    SampleRingPolicy policy;
+    SampleRingStats_t stats;
+} SampleRing_t;
+
+void sample_ring_init(SampleRing_t* ring, SampleRingPolicy policy);
+
+Sample_t* sample_ring_reserve(SampleRing_t* ring);
+void sample_ring_commit(SampleRing_t* ring);
+
+bool sample_ring_pop(SampleRing_t* ring, Sample_t* out);
+unsigned sample_ring_count(SampleRing_t* ring);
+
+#endif // _SAMPLE_RING_H_
@@ -0,0 +1,88 @@
+/*
+    uart_frame.h
+    Framing layer of the controller <-> ESP UART link.
+
+    Frame layout (all multi-byte fields little-endian):
+        | 0xAA | 0x55 | Version | Type | Seq | Len | Payload[Len] | CRC16 |
+    The CRC is CRC-16/CCITT-FALSE over Version..Payload (sync bytes excluded).
+    This file has no ESP-IDF dependency so it can also be built on the host.
+*/
+
+#ifndef _UART_FRAME_H_
+#define _UART_FRAME_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#include "TCPServer.h"
+
+#define UART_FRAME_SYNC0 (0xAA)
+#define UART_FRAME_SYNC1 (0x55)
+#define UART_FRAME_VERSION (1)
+
+#define UART_FRAME_HEADER_LEN (6)
+#define UART_FRAME_CRC_LEN (2)
+#define UART_FRAME_MAX_PAYLOAD (128)
+#define UART_FRAME_MAX_LEN (UART_FRAME_HEADER_LEN + UART_FRAME_MAX_PAYLOAD + UART_FRAME_CRC_LEN)
+
+// Sensor payload: Voltage, Temperature, roll, pitch, yaw, {Speed, Direction} * MOTOR_COUNT, Amps
+// 传感器负载: 电压, 温度, 欧拉角, 每个电机的转速与方向, 电流
+#define UART_FRAME_SENSOR_PAYLOAD_LEN (4 * 5 + 5 * CONFIG_MOTOR_COUNT + 4)
+// Reply payload: Seq of the command frame answered, Result (1 success, 0 failure)
+// 应答负载: 所应答命令帧的序号, 结果(1成功, 0失败)
+#define UART_FRAME_REPLY_PAYLOAD_LEN (2)
+
+typedef enum
+{
+    UART_FRAME_SENSOR = 0x01,  // Controller -> ESP, sensor sample
+    UART_FRAME_COMMAND = 0x02, // ESP -> controller, client command (see command.h)
+    UART_FRAME_REPLY = 0x03,   // Controller -> ESP, result of a command frame
+} UartFrameType;
+
+typedef struct
+{
+    uint32_t frames_ok;       // Frames that passed the CRC check
+    uint32_t crc_errors;      // Frames dropped because of a CRC mismatch
+    uint32_t header_errors;   // Sync found but version/length invalid
+    uint32_t bytes_discarded; // Bytes skipped while searching for a frame start
+    uint32_t seq_gaps;        // Frames missing according to the sequence number
+} UartFrameStats_t;
+
+/**
+ * @brief Called once for every frame that passed validation
+ * @param type Frame type (UartFrameType)
+ * @param seq Sequence number of the frame
+ * @param payload Pointer to the payload, only valid during the call
+ * @param len Payload length
+ * @param ctx User context given to uart_frame_decoder_init
+ */
+typedef void (*UartFrameHandler)(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, void* ctx);
+
+typedef struct
+{
+    uint8_t buf[UART_FRAME_MAX_LEN];
+    uint16_t fill;
+    bool seq_valid;
+    uint8_t next_seq;
+    uint32_t stream_pos; // Bytes fed so far
+    uint32_t frame_end;  // Stream offset just past the frame being handled, valid inside the handler
+    UartFrameHandler handler;
+    void* ctx;
+    UartFrameStats_t stats;
+} UartFrameDecoder_t;
+
+uint16_t uart_frame_crc16(const uint8_t* data, size_t len);
+
+void uart_frame_decoder_init(UartFrameDecoder_t* dec, UartFrameHandler handler, void* ctx);
+void uart_frame_decoder_feed(UartFrameDecoder_t* dec, const uint8_t* data, size_t len);
+
+size_t uart_frame_encode(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, uint8_t* out, size_t out_size);
+
+size_t uart_frame_pack_sensor(const SensorData_t* data, uint8_t* out, size_t out_size);
+bool uart_frame_unpack_sensor(const uint8_t* payload, uint8_t len, SensorData_t* out);
+
+#endif // _UART_FRAME_H_
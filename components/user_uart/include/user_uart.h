@@ -8,11 +8,37 @@
 #define _USER_UART_H_
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "TCPServer.h"
+#include "sample_ring.h"
+#include "uart_frame.h"
 
-void Init_uart(void);
-void uart_send(const char* msg, uint16_t msg_len);
+typedef struct
+{
+    UartFrameStats_t frames; // Decoder counters
+    uint32_t overflows;      // Driver RX overflows, each one flushes the pending input
+    uint32_t malformed;      // Sensor or reply frames with a valid CRC but an unexpected payload
+} UartRxStats_t;
+
+typedef struct
+{
+    uint32_t frames;      // Frames written to the driver
+    uint32_t writes;      // Driver writes, fewer than frames when frames were coalesced
+    uint32_t dropped;     // Frames refused because the queue was full
+    uint32_t depth;       // Frames waiting now
+    uint32_t depth_peak;  // Most frames waiting at once, including the one being taken
+    uint32_t wait_avg_us; // Time from queueing to the driver write
+    uint32_t wait_max_us;
+    uint32_t estop_count;   // Emergency stops written
+    uint32_t estop_last_us; // Time from receipt of the command to the driver write
+    uint32_t estop_max_us;
+} UartTxStats_t;
 
-extern QueueHandle_t uart_queue;
+void Init_uart(void);
+uint8_t uart_tx_seq(void);
+bool uart_send_frame(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, bool urgent, int64_t rx_at);
+bool uart_sample_receive(Sample_t* out, TickType_t wait);
+void uart_sample_stats(SampleRingStats_t* out);
+void uart_rx_stats(UartRxStats_t* out);
+void uart_tx_stats(UartTxStats_t* out);
 
 #endif // _USER_UART_H_
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include <string.h>
+#include "sample_ring.h"
+
+/**
+ * @brief Initialize an empty ring
+ * @param ring Ring
+ * @param policy What to do when the producer finds the ring full
+ * @retval None
+ */
+void sample_ring_init(SampleRing_t* ring, SampleRingPolicy policy)
+{
+    memset(ring->slots, 0, sizeof(ring->slots));
+    memset(&ring->stats, 0, sizeof(ring->stats));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->policy = policy;
+}
+
+/**
+ * @brief Get the next free slot so the producer can fill it in place
+ * @param ring Ring
+ * @retval Slot to fill, NULL if the ring is full and the policy is SAMPLE_RING_BLOCK
+ */
+Sample_t* sample_ring_reserve(SampleRing_t* ring)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (head - tail >= SAMPLE_RING_SIZE)
+    {
+        if (ring->policy == SAMPLE_RING_BLOCK)
+        {
+            ring->stats.stalls++;
+            return NULL;
+        }
+        // Evict the oldest sample. If the consumer popped it first the CAS fails,
+        // tail is reloaded and the ring is no longer full.
+        // 淘汰最旧的样本. 若消费者已先取走, CAS失败并重新加载tail, 此时环形缓冲区已不满.
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, tail + 1,
+            memory_order_acq_rel, memory_order_acquire))
+        {
+            ring->stats.overwritten++;
+            break;
+        }
+    }
+    return &ring->slots[head & SAMPLE_RING_MASK];
+}
+
+/**
+ * @brief Publish the slot returned by sample_ring_reserve to the consumer
+ * @param ring Ring
+ * @retval None
+ */
+void sample_ring_commit(SampleRing_t* ring)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief Copy out and remove a sample
+ * @param ring Ring
+ * @param out Destination
+ * @retval true if a sample was available
+ * @note Takes the oldest sample, or in SAMPLE_RING_LATEST mode the newest one,
+ *       discarding everything older
+ */
+bool sample_ring_pop(SampleRing_t* ring, Sample_t* out)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (1)
+    {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail)
+            return false;
+        unsigned idx = (ring->policy == SAMPLE_RING_LATEST) ? head - 1 : tail;
+        *out = ring->slots[idx & SAMPLE_RING_MASK];
+        // The copy is only valid if the producer did not evict the slot meanwhile,
+        // which it always does by advancing tail first
+        // 仅当生产者在此期间未淘汰该槽位时拷贝才有效, 生产者淘汰前总会先推进tail
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, idx + 1,
+            memory_order_acq_rel, memory_order_acquire))
+        {
+            ring->stats.skipped += idx - tail;
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief Number of samples waiting in the ring
+ * @param ring Ring
+ * @retval Sample count
+ */
+unsigned sample_ring_count(SampleRing_t* ring)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
@@ -0,0 +1,291 @@
+#include <string.h>
+#include "uart_frame.h"
+
+_Static_assert(UART_FRAME_SENSOR_PAYLOAD_LEN <= UART_FRAME_MAX_PAYLOAD, "CONFIG_MOTOR_COUNT too large for one UART frame");
+
+// CRC-16/CCITT-FALSE, polynomial 0x1021
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+/**
+ * @brief Compute CRC-16/CCITT-FALSE
+ * @param data Input buffer
+ * @param len Input length
+ * @retval CRC value
+ */
+uint16_t uart_frame_crc16(const uint8_t* data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++)
+        crc = (uint16_t)(crc << 8) ^ crc16_table[(uint8_t)(crc >> 8) ^ data[i]];
+    return crc;
+}
+
+static void put_f32(uint8_t* p, float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    p[0] = (uint8_t)u;
+    p[1] = (uint8_t)(u >> 8);
+    p[2] = (uint8_t)(u >> 16);
+    p[3] = (uint8_t)(u >> 24);
+}
+
+static float get_f32(const uint8_t* p)
+{
+    uint32_t u = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief Initialize a streaming frame decoder
+ * @param dec Decoder
+ * @param handler Callback invoked for every valid frame
+ * @param ctx User context passed to the callback
+ * @retval None
+ */
+void uart_frame_decoder_init(UartFrameDecoder_t* dec, UartFrameHandler handler, void* ctx)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->handler = handler;
+    dec->ctx = ctx;
+}
+
+/**
+ * @brief Parse as many complete frames as a byte span holds
+ * @param dec Decoder
+ * @param p Bytes to parse
+ * @param avail Number of bytes
+ * @param base Stream offset of p[0]
+ * @retval Number of bytes consumed, the rest is the start of an incomplete frame
+ */
+static size_t decoder_parse(UartFrameDecoder_t* dec, const uint8_t* p, size_t avail, uint32_t base)
+{
+    size_t pos = 0;
+    while (pos < avail)
+    {
+        const uint8_t* f = p + pos;
+        size_t left = avail - pos;
+
+        // Align to a sync word, discarding everything in front of it
+        // 对齐到同步字, 丢弃之前的所有字节
+        if (f[0] != UART_FRAME_SYNC0)
+        {
+            const uint8_t* sync = memchr(f, UART_FRAME_SYNC0, left);
+            size_t skip = sync ? (size_t)(sync - f) : left;
+            dec->stats.bytes_discarded += skip;
+            pos += skip;
+            continue;
+        }
+        if (left < 2)
+            break;
+        if (f[1] != UART_FRAME_SYNC1)
+        {
+            dec->stats.bytes_discarded++;
+            pos++;
+            continue;
+        }
+        if (left < UART_FRAME_HEADER_LEN)
+            break;
+
+        uint8_t len = f[5];
+        if (f[2] != UART_FRAME_VERSION || len > UART_FRAME_MAX_PAYLOAD)
+        {
+            // Not a real frame start, resume the search one byte later
+            // 不是有效帧头, 从下一个字节继续搜索
+            dec->stats.header_errors++;
+            dec->stats.bytes_discarded++;
+            pos++;
+            continue;
+        }
+
+        size_t total = UART_FRAME_HEADER_LEN + len + UART_FRAME_CRC_LEN;
+        if (left < total)
+            break;
+
+        uint16_t crc = (uint16_t)f[total - 2] | ((uint16_t)f[total - 1] << 8);
+        if (uart_frame_crc16(f + 2, UART_FRAME_HEADER_LEN - 2 + len) != crc)
+        {
+            // The sync word may have been payload data, so only skip one byte
+            // 同步字可能只是负载数据, 因此只跳过一个字节
+            dec->stats.crc_errors++;
+            dec->stats.bytes_discarded++;
+            pos++;
+            continue;
+        }
+
+        uint8_t seq = f[4];
+        if (dec->seq_valid && seq != dec->next_seq)
+            dec->stats.seq_gaps += (uint8_t)(seq - dec->next_seq);
+        dec->seq_valid = true;
+        dec->next_seq = (uint8_t)(seq + 1);
+        dec->stats.frames_ok++;
+        dec->frame_end = base + (uint32_t)(pos + total);
+
+        if (dec->handler)
+            dec->handler(f[3], seq, f + UART_FRAME_HEADER_LEN, len, dec->ctx);
+        pos += total;
+    }
+    return pos;
+}
+
+/**
+ * @brief Feed received bytes into the decoder
+ * @param dec Decoder
+ * @param data Received bytes, may start or end anywhere inside a frame
+ * @param len Number of bytes
+ * @retval None
+ * @note Frames that lie entirely inside data are parsed in place, only a frame
+ *       split across two calls is copied into the decoder buffer
+ */
+void uart_frame_decoder_feed(UartFrameDecoder_t* dec, const uint8_t* data, size_t len)
+{
+    uint32_t offset = dec->stream_pos;
+    dec->stream_pos += (uint32_t)len;
+
+    // Complete the frame left over from the previous call first
+    // 先补全上一次调用遗留的不完整帧
+    while (dec->fill > 0 && len > 0)
+    {
+        size_t space = sizeof(dec->buf) - dec->fill;
+        size_t n = len < space ? len : space;
+        uint32_t base = offset - dec->fill;
+        memcpy(dec->buf + dec->fill, data, n);
+        dec->fill += n;
+        data += n;
+        len -= n;
+        offset += (uint32_t)n;
+
+        size_t used = decoder_parse(dec, dec->buf, dec->fill, base);
+        dec->fill -= used;
+        memmove(dec->buf, dec->buf + used, dec->fill);
+    }
+
+    if (len > 0)
+    {
+        size_t used = decoder_parse(dec, data, len, offset);
+        dec->fill = len - used;
+        memcpy(dec->buf, data + used, dec->fill);
+    }
+}
+
+/**
+ * @brief Build a complete frame
+ * @param type Frame type
+ * @param seq Sequence number
+ * @param payload Payload bytes
+ * @param len Payload length
+ * @param out Output buffer
+ * @param out_size Size of the output buffer
+ * @retval Frame length, 0 if the output buffer is too small
+ */
+size_t uart_frame_encode(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, uint8_t* out, size_t out_size)
+{
+    size_t total = UART_FRAME_HEADER_LEN + len + UART_FRAME_CRC_LEN;
+    if (len > UART_FRAME_MAX_PAYLOAD || out_size < total)
+        return 0;
+
+    out[0] = UART_FRAME_SYNC0;
+    out[1] = UART_FRAME_SYNC1;
+    out[2] = UART_FRAME_VERSION;
+    out[3] = type;
+    out[4] = seq;
+    out[5] = len;
+    if (len)
+        memcpy(out + UART_FRAME_HEADER_LEN, payload, len);
+    uint16_t crc = uart_frame_crc16(out + 2, UART_FRAME_HEADER_LEN - 2 + len);
+    out[total - 2] = (uint8_t)crc;
+    out[total - 1] = (uint8_t)(crc >> 8);
+    return total;
+}
+
+/**
+ * @brief Serialize sensor data into a frame payload
+ * @param data Sensor data
+ * @param out Output buffer
+ * @param out_size Size of the output buffer
+ * @retval Payload length, 0 if the output buffer is too small
+ */
+size_t uart_frame_pack_sensor(const SensorData_t* data, uint8_t* out, size_t out_size)
+{
+    if (out_size < UART_FRAME_SENSOR_PAYLOAD_LEN)
+        return 0;
+
+    uint8_t* p = out;
+    put_f32(p, data->Voltage);     p += 4;
+    put_f32(p, data->Temperature); p += 4;
+    put_f32(p, data->euler.roll);  p += 4;
+    put_f32(p, data->euler.pitch); p += 4;
+    put_f32(p, data->euler.yaw);   p += 4;
+    for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+    {
+        put_f32(p, data->Motor[i].Speed); p += 4;
+        *p++ = (uint8_t)data->Motor[i].Direction;
+    }
+    put_f32(p, data->Amps);
+    return UART_FRAME_SENSOR_PAYLOAD_LEN;
+}
+
+/**
+ * @brief Deserialize a sensor frame payload
+ * @param payload Frame payload
+ * @param len Payload length
+ * @param out Decoded sensor data, WifiSignalStrength is left at 0
+ * @retval true if the payload has the expected size and valid fields
+ */
+bool uart_frame_unpack_sensor(const uint8_t* payload, uint8_t len, SensorData_t* out)
+{
+    if (len != UART_FRAME_SENSOR_PAYLOAD_LEN)
+        return false;
+
+    const uint8_t* p = payload;
+    memset(out, 0, sizeof(*out));
+    out->Voltage = get_f32(p);     p += 4;
+    out->Temperature = get_f32(p); p += 4;
+    out->euler.roll = get_f32(p);  p += 4;
+    out->euler.pitch = get_f32(p); p += 4;
+    out->euler.yaw = get_f32(p);   p += 4;
+    for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+    {
+        out->Motor[i].Speed = get_f32(p); p += 4;
+        if (*p > CCW)
+            return false;
+        out->Motor[i].Direction = (MotorDir)*p++;
+    }
+    out->Amps = get_f32(p);
+    return true;
+}
\ No newline at end of file
@@ -1,31 +1,314 @@
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include "user_uart.h"
+#include "uart_frame.h"
+#include "sample_ring.h"
 #include "TCPServer.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "driver/uart.h"
+#include "soc/soc_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #define BUFFER_SIZE (256)
+#define UART_EVENT_QUEUE_LEN (20)
+// RX timeout in symbol periods, an idle line this long ends the current burst
+// RX超时(以符号周期为单位), 线路空闲该时长即视为一帧结束
+#define UART_RX_TOUT_SYMBOLS (3)
+// Raise a data event as soon as one full sensor frame sits in the FIFO
+// FIFO中积累一个完整传感器帧即触发数据事件
+#define UART_RX_FULL_THRESH (UART_FRAME_HEADER_LEN + UART_FRAME_SENSOR_PAYLOAD_LEN + UART_FRAME_CRC_LEN)
 
-QueueHandle_t uart_queue;
+#ifdef CONFIG_UART_HW_FLOWCTRL
+#define UART_FLOW_CTRL UART_HW_FLOWCTRL_CTS_RTS
+#define UART_RTS_PIN CONFIG_UART_RTS_PIN
+#define UART_CTS_PIN CONFIG_UART_CTS_PIN
+#else
+#define UART_FLOW_CTRL UART_HW_FLOWCTRL_DISABLE
+#define UART_RTS_PIN UART_PIN_NO_CHANGE
+#define UART_CTS_PIN UART_PIN_NO_CHANGE
+#endif
+// Time on the line of one byte (start, 8 data and stop bit), in nanoseconds
+// 线路上传输一个字节(起始位, 8个数据位, 停止位)所需的时间, 单位纳秒
+#define UART_BYTE_NS (10 * 1000000000LL / CONFIG_UART_BAUD_RATE)
+// Deassert RTS a little before the hardware FIFO is full
+// 在硬件FIFO满之前提前拉高RTS
+#define UART_RTS_THRESH (SOC_UART_FIFO_LEN - 16)
+
+// One driver write carries at most this many bytes of coalesced frames
+// 一次驱动写入最多携带的合并帧字节数
+#define UART_TX_BATCH_LEN (UART_FRAME_MAX_LEN)
+
+_Static_assert(CONFIG_UART_TX_BUFFER_SIZE == 0 || CONFIG_UART_TX_BUFFER_SIZE > SOC_UART_FIFO_LEN,
+    "CONFIG_UART_TX_BUFFER_SIZE must be 0 or larger than the UART hardware FIFO");
+
+static QueueHandle_t uart_event_queue;
+
+// A frame waiting for the TX task, encoded there so senders only copy the payload
+// 等待TX任务发送的帧, 由TX任务编码, 发送方只需拷贝负载
+typedef struct
+{
+    uint8_t type;
+    uint8_t seq;
+    uint8_t len;
+    bool urgent;       // Emergency stop, written on its own
+    int64_t queued_at; // esp_timer time it was queued
+    int64_t rx_at;     // esp_timer time an emergency stop was received
+    uint8_t payload[UART_FRAME_MAX_PAYLOAD];
+} UartTxItem_t;
+
+static QueueHandle_t uart_tx_queue;
+static UartTxStats_t tx_stats;
+static uint64_t tx_wait_total_us = 0;
+// Refused frames, counted by the sending tasks
+// 被拒绝的帧数, 由各发送任务计数
+static atomic_uint tx_dropped = 0;
+// The emergency stop counters are also updated by a sender that writes directly
+// 急停计数也可能由直接写入的发送方更新
+static portMUX_TYPE tx_estop_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static UartFrameDecoder_t uart_decoder;
+static SampleRing_t sample_ring;
+static TaskHandle_t volatile sample_consumer = NULL;
+static TaskHandle_t volatile sample_producer = NULL;
+
+// Arrival bookkeeping of the bytes being decoded, see uart_drain_rx
+// 正在解码的字节的到达时间记录, 见uart_drain_rx
+static int64_t rx_time;        // Estimated arrival time of the newest buffered byte
+static uint32_t rx_line_end;   // Decoder stream offset just past the newest buffered byte
+static int64_t last_timestamp; // Keeps timestamps monotonic despite the estimate
+static uint32_t sample_seq = 0;
+static uint32_t rx_overflows = 0;
+static uint32_t rx_malformed = 0;
+
+#if defined(CONFIG_SAMPLE_OVERFLOW_LATEST)
+#define SAMPLE_POLICY SAMPLE_RING_LATEST
+#elif defined(CONFIG_SAMPLE_OVERFLOW_BLOCK)
+#define SAMPLE_POLICY SAMPLE_RING_BLOCK
+#else
+#define SAMPLE_POLICY SAMPLE_RING_DROP_OLDEST
+#endif
+
+/**
+ * @brief Handle one validated frame from the controller
+ * @param type Frame type
+ * @param seq Frame sequence number
+ * @param payload Frame payload
+ * @param len Payload length
+ * @param ctx Unused
+ * @retval None
+ */
+static void uart_frame_handler(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, void* ctx)
+{
+    if (type == UART_FRAME_REPLY)
+    {
+        if (len != UART_FRAME_REPLY_PAYLOAD_LEN || payload[1] > 1)
+        {
+            rx_malformed++;
+            ESP_LOGW("UART", "Malformed reply frame, seq %u, len %u", seq, len);
+            return;
+        }
+        Process_Controller_Reply(payload[0], payload[1] == 1);
+        return;
+    }
+    if (type != UART_FRAME_SENSOR)
+    {
+        ESP_LOGW("UART", "Unknown frame type 0x%02x, seq %u", type, seq);
+        return;
+    }
+
+    // Check the size before reserving so a bad frame never evicts a good sample
+    // 预留槽位前先检查长度, 避免错误帧淘汰有效样本
+    if (len != UART_FRAME_SENSOR_PAYLOAD_LEN)
+    {
+        rx_malformed++;
+        ESP_LOGW("UART", "Malformed sensor frame, seq %u, len %u", seq, len);
+        return;
+    }
+
+    // The bytes behind this frame arrived after its last byte, at most one byte time each
+    // 该帧之后的字节均晚于其最后一个字节到达, 每个字节间隔一个字节时间
+    uint32_t behind = rx_line_end - uart_decoder.frame_end;
+    int64_t timestamp = rx_time - (int64_t)behind * UART_BYTE_NS / 1000;
+    if (timestamp < last_timestamp)
+        timestamp = last_timestamp;
+    last_timestamp = timestamp;
+
+    // Numbered before the ring, so a sample the ring drops leaves a gap clients can see
+    // 在进入环形缓冲区前编号, 被环形缓冲区丢弃的样本会在客户端留下可见的序号缺口
+    uint32_t sample_number = sample_seq++;
+
+    // Decode straight into the ring slot, nothing is allocated on the sample path
+    // 直接解码到环形缓冲区槽位中, 采样路径上不分配任何内存
+    Sample_t* slot;
+    while ((slot = sample_ring_reserve(&sample_ring)) == NULL)
+    {
+        // Only reachable with the block policy: wait for the consumer to free a slot,
+        // meanwhile the driver RX buffer (and RTS, if enabled) holds back the controller
+        // 仅在阻塞策略下出现: 等待消费者释放槽位, 期间由驱动RX缓冲区(及RTS)暂存数据
+        sample_producer = xTaskGetCurrentTaskHandle();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+    }
+    sample_producer = NULL;
+    if (!uart_frame_unpack_sensor(payload, len, &slot->data))
+    {
+        rx_malformed++;
+        ESP_LOGW("UART", "Malformed sensor frame, seq %u, len %u", seq, len);
+        return;
+    }
+    slot->timestamp = timestamp;
+    slot->seq = sample_number;
+    sample_ring_commit(&sample_ring);
+
+    TaskHandle_t consumer = sample_consumer;
+    if (consumer)
+        xTaskNotifyGive(consumer);
+}
+
+/**
+ * @brief Read everything the driver has buffered and feed it to the decoder
+ * @param buffer Scratch buffer of BUFFER_SIZE bytes
+ * @param timeout Whether the data event was raised by the RX timeout
+ * @retval None
+ * @note The newest buffered byte arrived when the event was raised, or one RX timeout
+ *       earlier if the idle line raised it. Sample timestamps count back from there.
+ */
+static void uart_drain_rx(uint8_t* buffer, bool timeout)
+{
+    size_t avail = 0;
+    uart_get_buffered_data_len(UART_NUM_1, &avail);
+    rx_time = esp_timer_get_time();
+    if (timeout)
+        rx_time -= UART_RX_TOUT_SYMBOLS * UART_BYTE_NS / 1000;
+    rx_line_end = uart_decoder.stream_pos + (uint32_t)avail;
+    while (avail > 0)
+    {
+        int len = uart_read_bytes(UART_NUM_1, buffer, avail < BUFFER_SIZE ? avail : BUFFER_SIZE, 0);
+        if (len <= 0)
+            break;
+        uart_frame_decoder_feed(&uart_decoder, buffer, len);
+        avail -= len;
+    }
+}
 
 void uart_receive_task(void* pvParameters)
 {
     uint8_t buffer[BUFFER_SIZE];
+    uart_event_t event;
+    uart_frame_decoder_init(&uart_decoder, uart_frame_handler, NULL);
     while (1)
     {
-        int len = uart_read_bytes(UART_NUM_1, buffer, BUFFER_SIZE, pdMS_TO_TICKS(1000));
-        if (len > 0)
+        if (xQueueReceive(uart_event_queue, &event, portMAX_DELAY) != pdPASS)
+            continue;
+
+        switch (event.type)
         {
-            uint8_t* tmp_buf = malloc(len);
-            memcpy(tmp_buf, buffer, len);
-            if (xQueueSend(uart_queue, &tmp_buf, pdMS_TO_TICKS(10)) != pdPASS)
+        case UART_DATA:
+            // Raised on RX timeout or FIFO threshold, i.e. right after the last byte of a frame
+            // 由RX超时或FIFO阈值触发, 即帧的最后一个字节到达后立即触发
+            uart_drain_rx(buffer, event.timeout_flag);
+            break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            rx_overflows++;
+            ESP_LOGW("UART", "RX overflow, flushing input");
+            uart_flush_input(UART_NUM_1);
+            xQueueReset(uart_event_queue);
+            break;
+        case UART_FRAME_ERR:
+        case UART_PARITY_ERR:
+            ESP_LOGW("UART", "RX line error %d", event.type);
+            break;
+        default:
+            break;
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Frame one queued item into the batch buffer
+ * @param item Queued frame
+ * @param buf Batch buffer
+ * @param fill Bytes already in the batch, updated
+ * @param now esp_timer time of the coming write
+ * @retval false if the frame does not fit behind what the batch already holds
+ */
+static bool uart_tx_batch_add(const UartTxItem_t* item, uint8_t* buf, size_t* fill, int64_t now)
+{
+    size_t n = uart_frame_encode(item->type, item->seq, item->payload, item->len, buf + *fill, UART_TX_BATCH_LEN - *fill);
+    if (n == 0)
+        return false;
+    *fill += n;
+
+    uint32_t wait_us = (uint32_t)(now - item->queued_at);
+    tx_stats.frames++;
+    tx_wait_total_us += wait_us;
+    if (wait_us > tx_stats.wait_max_us)
+        tx_stats.wait_max_us = wait_us;
+    return true;
+}
+
+/**
+ * @brief Account an emergency stop just handed to the driver
+ * @param rx_at esp_timer time the stop was received from its client
+ * @retval None
+ */
+static void uart_tx_estop_account(int64_t rx_at)
+{
+    uint32_t latency_us = (uint32_t)(esp_timer_get_time() - rx_at);
+    taskENTER_CRITICAL(&tx_estop_lock);
+    tx_stats.estop_count++;
+    tx_stats.estop_last_us = latency_us;
+    if (latency_us > tx_stats.estop_max_us)
+        tx_stats.estop_max_us = latency_us;
+    taskEXIT_CRITICAL(&tx_estop_lock);
+    ESP_LOGW("UART", "Emergency stop written %u us after receipt", (unsigned)latency_us);
+}
+
+/**
+ * @brief UART TX task, the only writer of the controller link besides an
+ *        emergency stop that finds the queue full
+ * @param pvParameters Unused
+ * @retval None
+ * @note Frames queued while the previous write was in progress go out together
+ *       in one driver write, in queue order. An emergency stop, queued at the
+ *       front, is written on its own so its latency ends at its own write.
+ */
+static void uart_transmit_task(void* pvParameters)
+{
+    uint8_t buf[UART_TX_BATCH_LEN];
+    UartTxItem_t item;
+    bool held = false;
+    while (1)
+    {
+        if (!held && xQueueReceive(uart_tx_queue, &item, portMAX_DELAY) != pdPASS)
+            continue;
+        held = false;
+
+        int64_t now = esp_timer_get_time();
+        size_t fill = 0;
+        UBaseType_t depth = uxQueueMessagesWaiting(uart_tx_queue) + 1;
+        if (depth > tx_stats.depth_peak)
+            tx_stats.depth_peak = depth;
+        if (!uart_tx_batch_add(&item, buf, &fill, now))
+            continue;
+        bool urgent = item.urgent;
+        int64_t rx_at = item.rx_at;
+        // Take whatever else is waiting, a frame that does not fit or an emergency stop opens the next batch
+        // 取出其余等待中的帧, 放不下的帧或急停命令留作下一批的开头
+        while (!urgent && xQueueReceive(uart_tx_queue, &item, 0) == pdPASS)
+            if (item.urgent || !uart_tx_batch_add(&item, buf, &fill, now))
             {
-                ESP_LOGW("UART", "Queue full, dropping sensor data");
-                free(tmp_buf);
+                held = true;
+                break;
             }
-        }
+        tx_stats.writes++;
+        uart_write_bytes(UART_NUM_1, buf, fill);
+        if (urgent)
+            uart_tx_estop_account(rx_at);
     }
     vTaskDelete(NULL);
 }
@@ -33,23 +316,141 @@ void uart_receive_task(void* pvParameters)
 void Init_uart(void)
 {
     uart_config_t config = {
-        .baud_rate = 115200,
+        .baud_rate = CONFIG_UART_BAUD_RATE,
         .data_bits = UART_DATA_8_BITS,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .flow_ctrl = UART_FLOW_CTRL,
+        .rx_flow_ctrl_thresh = UART_RTS_THRESH,
         .parity = UART_PARITY_DISABLE,
         .source_clk = UART_SCLK_DEFAULT,
         .stop_bits = 1,
     };
 
-    uart_driver_install(UART_NUM_1, BUFFER_SIZE, 0, 0, NULL, 0);
+    uart_driver_install(UART_NUM_1, CONFIG_UART_RX_BUFFER_SIZE, CONFIG_UART_TX_BUFFER_SIZE, UART_EVENT_QUEUE_LEN, &uart_event_queue, 0);
     uart_param_config(UART_NUM_1, &config);
-    uart_set_pin(UART_NUM_1, CONFIG_UART_TX_PIN, CONFIG_UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_set_pin(UART_NUM_1, CONFIG_UART_TX_PIN, CONFIG_UART_RX_PIN, UART_RTS_PIN, UART_CTS_PIN);
+    uart_set_rx_timeout(UART_NUM_1, UART_RX_TOUT_SYMBOLS);
+    uart_set_rx_full_threshold(UART_NUM_1, UART_RX_FULL_THRESH);
 
-    uart_queue = xQueueCreate(5, sizeof(uint8_t*));
+    sample_ring_init(&sample_ring, SAMPLE_POLICY);
+    uart_tx_queue = xQueueCreate(CONFIG_UART_TX_QUEUE_LEN, sizeof(UartTxItem_t));
     xTaskCreate(uart_receive_task, "uart receive task", 4096, NULL, 10, NULL);
+    xTaskCreate(uart_transmit_task, "uart transmit task", 3072, NULL, 9, NULL);
 }
 
-void uart_send(const char* msg, uint16_t msg_len)
+/**
+ * @brief Take the sequence number of the next frame sent to the controller
+ * @retval Sequence number
+ * @note Taken apart from uart_send_frame so a command can be registered under its
+ *       number before the controller can possibly answer it
+ */
+uint8_t uart_tx_seq(void)
 {
-    uart_write_bytes(UART_NUM_1, msg, msg_len);
-}
\ No newline at end of file
+    static atomic_uint tx_seq = 0;
+    return (uint8_t)atomic_fetch_add(&tx_seq, 1);
+}
+
+/**
+ * @brief Queue one frame for the controller
+ * @param type Frame type (UartFrameType)
+ * @param seq Sequence number from uart_tx_seq
+ * @param payload Payload bytes
+ * @param len Payload length, at most UART_FRAME_MAX_PAYLOAD
+ * @param urgent Emergency stop: queued ahead of every waiting frame
+ * @param rx_at esp_timer time an urgent frame was received, its latency is
+ *        measured from there to its driver write; ignored otherwise
+ * @retval false if the queue was full and the frame dropped
+ * @note Safe to call from several tasks and never waits for the line. An urgent
+ *       frame that finds the queue full is written directly instead; the driver
+ *       writes each call in one piece, so it cannot split a batch.
+ */
+bool uart_send_frame(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, bool urgent, int64_t rx_at)
+{
+    if (len > UART_FRAME_MAX_PAYLOAD)
+        return false;
+    UartTxItem_t item = {
+        .type = type,
+        .seq = seq,
+        .len = len,
+        .urgent = urgent,
+        .queued_at = esp_timer_get_time(),
+        .rx_at = rx_at,
+    };
+    memcpy(item.payload, payload, len);
+
+    BaseType_t queued = urgent ? xQueueSendToFront(uart_tx_queue, &item, 0) : xQueueSendToBack(uart_tx_queue, &item, 0);
+    if (queued == pdPASS)
+        return true;
+    if (urgent)
+    {
+        uint8_t frame[UART_FRAME_MAX_LEN];
+        size_t n = uart_frame_encode(type, seq, payload, len, frame, sizeof(frame));
+        uart_write_bytes(UART_NUM_1, frame, n);
+        uart_tx_estop_account(rx_at);
+        return true;
+    }
+    atomic_fetch_add(&tx_dropped, 1);
+    return false;
+}
+
+/**
+ * @brief Get the counters of the UART TX queue
+ * @param out Destination
+ * @retval None
+ */
+void uart_tx_stats(UartTxStats_t* out)
+{
+    taskENTER_CRITICAL(&tx_estop_lock);
+    *out = tx_stats;
+    taskEXIT_CRITICAL(&tx_estop_lock);
+    out->dropped = atomic_load(&tx_dropped);
+    out->depth = uxQueueMessagesWaiting(uart_tx_queue);
+    out->wait_avg_us = tx_stats.frames ? (uint32_t)(tx_wait_total_us / tx_stats.frames) : 0;
+}
+
+/**
+ * @brief Take the next sensor sample, blocking until one arrives
+ * @param out Destination, with the arrival time and number of the sample
+ * @param wait Maximum time to wait
+ * @retval true if a sample was copied to out
+ * @note Must only be called from one task, the ring has a single consumer
+ */
+bool uart_sample_receive(Sample_t* out, TickType_t wait)
+{
+    sample_consumer = xTaskGetCurrentTaskHandle();
+    while (!sample_ring_pop(&sample_ring, out))
+    {
+        // The producer notifies after every commit, a notification given
+        // between the pop above and this take is not lost
+        // 生产者每次提交后都会通知, 在上面pop与此处take之间发出的通知不会丢失
+        if (ulTaskNotifyTake(pdTRUE, wait) == 0)
+            return false;
+    }
+
+    TaskHandle_t producer = sample_producer;
+    if (producer)
+        xTaskNotifyGive(producer);
+    return true;
+}
+
+/**
+ * @brief Get the overflow counters of the sample ring
+ * @param out Destination
+ * @retval None
+ */
+void uart_sample_stats(SampleRingStats_t* out)
+{
+    *out = sample_ring.stats;
+}
+
+/**
+ * @brief Get the loss counters of the UART link
+ * @param out Destination
+ * @retval None
+ * @note Frames lost on the line show up as seq_gaps, whatever the reason
+ */
+void uart_rx_stats(UartRxStats_t* out)
+{
+    out->frames = uart_decoder.stats;
+    out->overflows = rx_overflows;
+    out->malformed = rx_malformed;
+}
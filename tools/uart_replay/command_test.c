@@ -0,0 +1,252 @@
+/*
+    uart_replay command_test.c
+    Host test of the firmware command codec: parse_command edge cases, the
+    pack/unpack round trip through a command frame, and, with "bench", the
+    time a console command takes to parse and a binary command to unpack.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "command.h"
+#include "uart_frame.h"
+
+static unsigned failures = 0;
+
+// Count a failed check and carry on, so one run reports every failure
+// 记录失败的检查并继续, 一次运行即可报告所有失败
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * @brief Parse a NUL terminated command
+ * @param msg Command text
+ * @param out Parsed command
+ * @retval Result of parse_command
+ */
+static CommandStatus parse(const char* msg, Command* out)
+{
+    return parse_command(msg, strlen(msg), out);
+}
+
+typedef struct
+{
+    const char* msg;
+    CommandStatus status;
+} ParseCase_t;
+
+static const ParseCase_t parse_cases[] = {
+    { "move 0 S W 100 0", CMD_OK },
+    { "\tmove  0 S   W 100 0 ", CMD_OK },
+    { "move 0 S W +100 -0", CMD_OK },
+    { "", CMD_ERR_EMPTY },
+    { "   ", CMD_ERR_EMPTY },
+    { "jump 1", CMD_ERR_UNKNOWN },
+    { "Move 0 S W 100 0", CMD_ERR_UNKNOWN },
+    // Sign only, stray characters
+    // 只有符号, 夹杂其他字符
+    { "move 0 S W - 0", CMD_ERR_BAD_INT },
+    { "move 0 S W + 0", CMD_ERR_BAD_INT },
+    { "move 0 S W 1x 0", CMD_ERR_BAD_INT },
+    { "move 0 S W 0x10 0", CMD_ERR_BAD_INT },
+    { "move 0 S W --1 0", CMD_ERR_BAD_INT },
+    // int32 limits
+    // int32 边界
+    { "move 0 S W 2147483647 -2147483648", CMD_OK },
+    { "move 0 S W 2147483648 0", CMD_ERR_BAD_INT },
+    { "move 0 S W -2147483649 0", CMD_ERR_BAD_INT },
+    { "move 0 S W 99999999999 0", CMD_ERR_BAD_INT },
+    // Missing and extra arguments
+    // 参数缺失与多余
+    { "move", CMD_ERR_MISSING_ARG },
+    { "move 0 S W 100", CMD_ERR_MISSING_ARG },
+    { "spin L", CMD_ERR_MISSING_ARG },
+    { "move 0 S W 100 0 0", CMD_ERR_EXTRA_ARG },
+    { "motor 1 C 90 x", CMD_ERR_EXTRA_ARG },
+    // Argument types and ranges
+    // 参数类型与范围
+    { "move 0 SD W 100 0", CMD_ERR_BAD_CHAR },
+    { "move 0 S WASDWASDWASDWAS 100 0", CMD_OK },
+    { "move 0 S WASDWASDWASDWASD 100 0", CMD_ERR_TOO_LONG },
+    { "move 2 S W 100 0", CMD_ERR_RANGE },
+    { "move 0 X W 100 0", CMD_ERR_RANGE },
+    { "move 0 S WQ 100 0", CMD_ERR_RANGE },
+    { "spin X 90", CMD_ERR_RANGE },
+    { "motor 0 C 90", CMD_ERR_RANGE },
+    { "motor 1 x 90", CMD_OK },
+};
+
+static void test_parse(void)
+{
+    for (size_t i = 0;i < sizeof(parse_cases) / sizeof(parse_cases[0]);i++)
+    {
+        Command cmd;
+        CommandStatus status = parse(parse_cases[i].msg, &cmd);
+        if (status != parse_cases[i].status)
+        {
+            fprintf(stderr, "parse \"%s\": %s, expected %s\n", parse_cases[i].msg,
+                command_status_str(status), command_status_str(parse_cases[i].status));
+            failures++;
+        }
+        CHECK(status == CMD_OK || cmd.type == CMD_UNKNOWN);
+    }
+
+    Command cmd;
+    CHECK(parse("move 0 S W 2147483647 -2147483648", &cmd) == CMD_OK);
+    CHECK(cmd.params.move.value == INT32_MAX && cmd.params.move.time == INT32_MIN);
+    CHECK(parse("motor 2 A -300", &cmd) == CMD_OK);
+    CHECK(cmd.type == CMD_MOTOR && cmd.params.motor.motorID == 2 && cmd.params.motor.dir == 'A' && cmd.params.motor.angle == -300);
+
+    // The length bounds the message, it need not be NUL terminated
+    // 消息以长度为界, 无需以NUL结尾
+    const char* msg = "spin R 90 trailing";
+    CHECK(parse_command(msg, 9, &cmd) == CMD_OK && cmd.params.spin.angle == 90);
+    CHECK(parse_command(msg, 8, &cmd) == CMD_OK && cmd.params.spin.angle == 9);
+    CHECK(parse_command(msg, 6, &cmd) == CMD_ERR_MISSING_ARG);
+
+    // An emergency stop is recognised from its first argument alone
+    // 急停命令仅凭第一个参数即可识别
+    CHECK(command_parse_estop("move 1", 6, &cmd) && cmd.params.move.stop == 1 && command_validate(&cmd) == CMD_OK);
+    CHECK(command_parse_estop("move 1 s w 0 0", 14, &cmd));
+    CHECK(!command_parse_estop("move 0 S W 1 1", 14, &cmd));
+    CHECK(!command_parse_estop("move 1x", 7, &cmd));
+    CHECK(!command_parse_estop("spin 1", 6, &cmd));
+}
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t payload[UART_FRAME_MAX_PAYLOAD];
+    uint8_t len;
+    unsigned frames;
+} FrameCapture_t;
+
+static void capture_frame(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, void* ctx)
+{
+    (void)seq;
+    FrameCapture_t* cap = ctx;
+    cap->type = type;
+    cap->len = len;
+    memcpy(cap->payload, payload, len);
+    cap->frames++;
+}
+
+static const char* const round_trip_cases[] = {
+    "move 1 S WD 100 200",
+    "move 0 D WASDWASDWASDWAS -2147483648 2147483647",
+    "spin R 360",
+    "spin L -1",
+    "motor 2 A -300",
+    "motor 1 C 2147483647",
+};
+
+static void test_round_trip(void)
+{
+    for (size_t i = 0;i < sizeof(round_trip_cases) / sizeof(round_trip_cases[0]);i++)
+    {
+        Command cmd, back;
+        CHECK(parse(round_trip_cases[i], &cmd) == CMD_OK);
+
+        uint8_t payload[COMMAND_PAYLOAD_MAX_LEN + 1];
+        size_t len = command_pack(&cmd, payload, sizeof(payload));
+        CHECK(len > 1 && len <= COMMAND_PAYLOAD_MAX_LEN);
+        CHECK(command_unpack(payload, len, &back) == CMD_OK);
+        CHECK(memcmp(&cmd, &back, sizeof(cmd)) == 0);
+
+        // Short, long and unknown payloads are rejected
+        // 过短、过长与未知类型的负载均被拒绝
+        CHECK(command_unpack(payload, len - 1, &back) == CMD_ERR_MISSING_ARG);
+        CHECK(back.type == CMD_UNKNOWN);
+        payload[len] = 0;
+        CHECK(command_unpack(payload, len + 1, &back) == CMD_ERR_EXTRA_ARG);
+        CHECK(command_unpack(payload, 0, &back) == CMD_ERR_EMPTY);
+        payload[0] = CMD_COUNT;
+        CHECK(command_unpack(payload, len, &back) == CMD_ERR_UNKNOWN);
+
+        // Through a whole command frame and the firmware frame decoder
+        // 经过完整的命令帧与固件帧解码器
+        uint8_t frame[COMMAND_FRAME_MAX_LEN];
+        size_t frame_len = command_encode_frame(&cmd, (uint8_t)i, frame, sizeof(frame));
+        CHECK(frame_len == UART_FRAME_HEADER_LEN + len + UART_FRAME_CRC_LEN);
+        FrameCapture_t cap = { 0 };
+        UartFrameDecoder_t dec;
+        uart_frame_decoder_init(&dec, capture_frame, &cap);
+        uart_frame_decoder_feed(&dec, frame, frame_len);
+        CHECK(cap.frames == 1 && cap.type == UART_FRAME_COMMAND);
+        CHECK(command_unpack(cap.payload, cap.len, &back) == CMD_OK);
+        CHECK(memcmp(&cmd, &back, sizeof(cmd)) == 0);
+    }
+
+    // A stop whose other arguments are garbage still unpacks to the canonical stop
+    // 其余参数无效的急停命令仍可解出固定的急停命令
+    uint8_t stop[] = { CMD_MOVE, 1, 'Z' };
+    Command cmd;
+    CHECK(command_unpack(stop, sizeof(stop), &cmd) != CMD_OK);
+    CHECK(command_unpack_estop(stop, sizeof(stop), &cmd) && command_validate(&cmd) == CMD_OK);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Time parse_command and command_unpack on a typical move command
+ * @retval None
+ * @note Host numbers only; on the device CONFIG_COMMAND_PROFILE logs the same
+ */
+static void bench(void)
+{
+    const char* msg = "move 0 D WA 100 0";
+    size_t msg_len = strlen(msg);
+    Command cmd;
+    parse_command(msg, msg_len, &cmd);
+    uint8_t payload[COMMAND_PAYLOAD_MAX_LEN];
+    size_t len = command_pack(&cmd, payload, sizeof(payload));
+
+    const long rounds = 2000000;
+    volatile unsigned sink = 0;
+    double t0 = now_ns();
+    for (long i = 0;i < rounds;i++)
+        sink += parse_command(msg, msg_len, &cmd);
+    double t1 = now_ns();
+    for (long i = 0;i < rounds;i++)
+        sink += command_unpack(payload, len, &cmd);
+    double t2 = now_ns();
+    (void)sink;
+
+    printf("parse_command   \"%s\": %.1f ns\n", msg, (t1 - t0) / rounds);
+    printf("command_unpack  %zu byte payload: %.1f ns\n", len, (t2 - t1) / rounds);
+}
+
+int main(int argc, char** argv)
+{
+    command_init();
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench();
+        return 0;
+    }
+
+    test_parse();
+    test_round_trip();
+    if (failures)
+    {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("command codec: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,502 @@
+/*
+    uart_replay main.c
+    Host harness for the UART ingest path: feeds a captured, live (tty/pty) or
+    synthetic byte stream into the firmware frame decoder and sample ring at a
+    configurable rate, optionally injecting faults, and reports decoder
+    throughput, rejected frames and resynchronization distance. Command frames
+    (a capture of the ESP -> controller line) are decoded with the firmware
+    command decoder and counted, and so are controller reply frames.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "uart_frame.h"
+#include "sample_ring.h"
+
+#define CHUNK_MAX (4096)
+
+typedef struct
+{
+    const char* input;   // Capture file or tty/pty, NULL to generate frames
+    const char* output;  // Optional copy of the stream after fault injection
+    long frames;         // Number of synthetic frames
+    long baud;           // Line rate used for pacing, 0 feeds as fast as possible
+    size_t chunk;        // Bytes handed to the decoder per read
+    double drop;         // Per-byte probability of dropping the byte
+    double flip;         // Per-byte probability of flipping one bit
+    double trunc;        // Per-chunk probability of cutting the chunk short
+    uint32_t seed;
+    SampleRingPolicy policy;
+} Options_t;
+
+typedef struct
+{
+    uint64_t bytes_in;        // Bytes read from the source
+    uint64_t bytes_fed;       // Bytes given to the decoder after fault injection
+    uint64_t drops;
+    uint64_t flips;
+    uint64_t truncs;
+    uint64_t malformed;       // Valid CRC but unusable sensor payload
+    uint64_t commands;        // Command frames that decoded and validated
+    uint64_t commands_bad;    // Command frames with a valid CRC but a rejected payload
+    uint64_t replies;         // Controller reply frames
+    uint64_t consumed;        // Samples taken out of the ring
+    uint64_t mismatched;      // Generated samples that did not decode to the original values
+    uint64_t resyncs;         // Faults followed by a valid frame
+    uint64_t resync_bytes;    // Sum of bytes between a fault and the next valid frame
+    uint64_t resync_max;
+    double decode_seconds;    // Time spent inside the decoder and ring
+} Report_t;
+
+static Options_t opt = {
+    .frames = 10000,
+    .chunk = 64,
+    .seed = 1,
+    .policy = SAMPLE_RING_DROP_OLDEST,
+};
+static Report_t report;
+static volatile sig_atomic_t stop_requested = 0;
+
+static UartFrameDecoder_t decoder;
+static SampleRing_t ring;
+static uint32_t sample_seq = 0;
+
+// Stream position bookkeeping for the resync measurement
+// 用于测量重新同步距离的流位置记录
+static uint64_t chunk_base;
+static bool fault_pending = false;
+static uint64_t fault_pos;
+
+static uint32_t rng_state;
+
+static uint32_t rng_next(void)
+{
+    // xorshift32, reproducible for a given seed on every host
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+
+static bool rng_chance(double p)
+{
+    return p > 0 && (rng_next() / 4294967296.0) < p;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+ * @brief Fill a sample whose fields are all derived from its index
+ * @param n Frame index
+ * @param data Output sample
+ * @retval None
+ */
+static void synth_sample(uint32_t n, SensorData_t* data)
+{
+    memset(data, 0, sizeof(*data));
+    float base = (float)(n & 0xFFFF);
+    data->Voltage = base;
+    data->Temperature = base + 1;
+    data->euler.roll = base + 2;
+    data->euler.pitch = base + 3;
+    data->euler.yaw = base + 4;
+    for (int i = 0; i < CONFIG_MOTOR_COUNT; i++)
+    {
+        data->Motor[i].Speed = base + 10 + i;
+        data->Motor[i].Direction = ((n + i) & 1) ? CCW : CW;
+    }
+    data->Amps = base + 5;
+}
+
+/**
+ * @brief Check that a decoded sample matches what synth_sample produced
+ * @param data Decoded sample
+ * @retval true if consistent
+ */
+static bool synth_check(const SensorData_t* data)
+{
+    SensorData_t ref;
+    float base = data->Voltage;
+    if (base < 0 || base > 0xFFFF || base != (float)(uint32_t)base)
+        return false;
+    synth_sample((uint32_t)base, &ref);
+    return memcmp(&ref, data, sizeof(ref)) == 0;
+}
+
+/**
+ * @brief Take one sample out of the ring, as the telemetry task would
+ * @retval true if a sample was available
+ */
+static bool consume_sample(void)
+{
+    Sample_t sample;
+    if (!sample_ring_pop(&ring, &sample))
+        return false;
+    report.consumed++;
+    if (opt.input == NULL && !synth_check(&sample.data))
+        report.mismatched++;
+    return true;
+}
+
+static void frame_handler(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, void* ctx)
+{
+    (void)seq;
+    (void)ctx;
+
+    // The decoder reports the frame end as a 32-bit stream offset, widen it
+    // relative to the current chunk. A frame that started in an earlier chunk
+    // can end before chunk_base, so the difference is signed.
+    // 解码器以32位流偏移给出帧尾位置, 相对当前块将其扩展为64位, 差值可能为负
+    uint64_t end = chunk_base + (int64_t)(int32_t)(decoder.frame_end - (uint32_t)chunk_base);
+    if (fault_pending && end > fault_pos)
+    {
+        uint64_t dist = end - fault_pos;
+        report.resyncs++;
+        report.resync_bytes += dist;
+        if (dist > report.resync_max)
+            report.resync_max = dist;
+        fault_pending = false;
+    }
+
+    if (type == UART_FRAME_COMMAND)
+    {
+        Command cmd;
+        if (command_unpack(payload, len, &cmd) == CMD_OK)
+            report.commands++;
+        else
+            report.commands_bad++;
+        return;
+    }
+    if (type == UART_FRAME_REPLY && len == UART_FRAME_REPLY_PAYLOAD_LEN && payload[1] <= 1)
+    {
+        report.replies++;
+        return;
+    }
+    if (type != UART_FRAME_SENSOR || len != UART_FRAME_SENSOR_PAYLOAD_LEN)
+    {
+        report.malformed++;
+        return;
+    }
+    Sample_t* slot = sample_ring_reserve(&ring);
+    if (slot == NULL)
+    {
+        // Block policy: a single-threaded harness cannot wait, let the "consumer" catch up
+        // 阻塞策略: 单线程测试无法等待, 由"消费者"先取出一个样本
+        consume_sample();
+        slot = sample_ring_reserve(&ring);
+    }
+    if (!uart_frame_unpack_sensor(payload, len, &slot->data))
+    {
+        report.malformed++;
+        return;
+    }
+    slot->timestamp = (int64_t)(now_seconds() * 1e6);
+    slot->seq = sample_seq++;
+    sample_ring_commit(&ring);
+}
+
+/**
+ * @brief Apply the configured faults to a chunk in place
+ * @param buf Chunk
+ * @param len Chunk length
+ * @retval New chunk length
+ */
+static size_t inject_faults(uint8_t* buf, size_t len)
+{
+    size_t out = 0;
+    if (len > 0 && rng_chance(opt.trunc))
+    {
+        size_t cut = rng_next() % len;
+        report.truncs++;
+        if (!fault_pending)
+        {
+            fault_pending = true;
+            fault_pos = report.bytes_fed + cut;
+        }
+        len = cut;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t b = buf[i];
+        if (rng_chance(opt.drop))
+        {
+            report.drops++;
+            if (!fault_pending)
+            {
+                fault_pending = true;
+                fault_pos = report.bytes_fed + out;
+            }
+            continue;
+        }
+        if (rng_chance(opt.flip))
+        {
+            b ^= (uint8_t)(1u << (rng_next() & 7));
+            report.flips++;
+            if (!fault_pending)
+            {
+                fault_pending = true;
+                fault_pos = report.bytes_fed + out;
+            }
+        }
+        buf[out++] = b;
+    }
+    return out;
+}
+
+// Synthetic source state
+// 合成数据源状态
+static uint8_t gen_frame[UART_FRAME_MAX_LEN];
+static size_t gen_len = 0;
+static size_t gen_pos = 0;
+static long gen_index = 0;
+
+static size_t generate_read(uint8_t* buf, size_t max)
+{
+    size_t n = 0;
+    while (n < max)
+    {
+        if (gen_pos == gen_len)
+        {
+            if (gen_index >= opt.frames)
+                break;
+            SensorData_t data;
+            uint8_t payload[UART_FRAME_MAX_PAYLOAD];
+            synth_sample((uint32_t)gen_index, &data);
+            size_t plen = uart_frame_pack_sensor(&data, payload, sizeof(payload));
+            gen_len = uart_frame_encode(UART_FRAME_SENSOR, (uint8_t)gen_index, payload, (uint8_t)plen, gen_frame, sizeof(gen_frame));
+            gen_pos = 0;
+            gen_index++;
+        }
+        size_t k = gen_len - gen_pos;
+        if (k > max - n)
+            k = max - n;
+        memcpy(buf + n, gen_frame + gen_pos, k);
+        gen_pos += k;
+        n += k;
+    }
+    return n;
+}
+
+/**
+ * @brief Put a tty/pty into raw mode so the line discipline does not alter bytes
+ * @param fd Open file descriptor
+ * @retval None
+ */
+static void setup_tty(int fd)
+{
+    struct termios tio;
+    if (!isatty(fd) || tcgetattr(fd, &tio) != 0)
+        return;
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+static SampleRingPolicy parse_policy(const char* s)
+{
+    if (strcmp(s, "latest") == 0)
+        return SAMPLE_RING_LATEST;
+    if (strcmp(s, "block") == 0)
+        return SAMPLE_RING_BLOCK;
+    if (strcmp(s, "drop-oldest") != 0)
+        fprintf(stderr, "Unknown policy '%s', using drop-oldest\n", s);
+    return SAMPLE_RING_DROP_OLDEST;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -i <path>    replay a capture file or read a tty/pty (default: synthetic frames)\n"
+        "  -n <frames>  number of synthetic frames (default 10000)\n"
+        "  -o <path>    write the stream after fault injection to a file\n"
+        "  -b <baud>    pace synthetic or file input at this UART baud rate (default 0: unpaced)\n"
+        "  -c <bytes>   bytes per decoder call (default 64, max %d)\n"
+        "  -d <p>       per-byte drop probability\n"
+        "  -f <p>       per-byte bit flip probability\n"
+        "  -t <p>       per-chunk truncation probability\n"
+        "  -s <seed>    fault injection seed (default 1)\n"
+        "  -p <policy>  ring overflow policy: drop-oldest, latest, block\n",
+        prog, CHUNK_MAX);
+}
+
+static void print_report(double wall)
+{
+    const UartFrameStats_t* st = &decoder.stats;
+    double bps = opt.baud > 0 ? opt.baud / 10.0 : 0;
+
+    printf("bytes read           %llu\n", (unsigned long long)report.bytes_in);
+    printf("bytes fed            %llu\n", (unsigned long long)report.bytes_fed);
+    printf("faults injected      drop %llu, flip %llu, truncate %llu\n",
+        (unsigned long long)report.drops, (unsigned long long)report.flips, (unsigned long long)report.truncs);
+    printf("frames decoded       %u\n", st->frames_ok);
+    printf("frames rejected      crc %u, header %u, malformed %llu\n",
+        st->crc_errors, st->header_errors, (unsigned long long)report.malformed);
+    printf("bytes discarded      %u\n", st->bytes_discarded);
+    printf("sequence gaps        %u\n", st->seq_gaps);
+    if (report.commands + report.commands_bad > 0)
+        printf("commands             %llu decoded, %llu rejected\n",
+            (unsigned long long)report.commands, (unsigned long long)report.commands_bad);
+    if (report.replies > 0)
+        printf("replies              %llu\n", (unsigned long long)report.replies);
+    printf("samples consumed     %llu\n", (unsigned long long)report.consumed);
+    printf("ring                 overwritten %u, skipped %u, stalls %u\n",
+        ring.stats.overwritten, ring.stats.skipped, ring.stats.stalls);
+    if (opt.input == NULL)
+        printf("corrupt accepted     %llu\n", (unsigned long long)report.mismatched);
+    if (report.resyncs > 0)
+    {
+        double avg = (double)report.resync_bytes / report.resyncs;
+        printf("resync               %llu events, avg %.1f bytes, max %llu bytes",
+            (unsigned long long)report.resyncs, avg, (unsigned long long)report.resync_max);
+        if (bps > 0)
+            printf(" (avg %.3f ms, max %.3f ms at %ld baud)", avg * 1000 / bps, report.resync_max * 1000 / bps, opt.baud);
+        printf("\n");
+    }
+    if (report.decode_seconds > 0)
+        printf("decoder throughput   %.0f frames/s, %.1f MB/s\n",
+            st->frames_ok / report.decode_seconds, report.bytes_fed / report.decode_seconds / 1e6);
+    if (wall > 0)
+        printf("stream rate          %.0f frames/s over %.3f s\n", st->frames_ok / wall, wall);
+}
+
+int main(int argc, char** argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "i:n:o:b:c:d:f:t:s:p:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'i': opt.input = optarg; break;
+        case 'n': opt.frames = strtol(optarg, NULL, 0); break;
+        case 'o': opt.output = optarg; break;
+        case 'b': opt.baud = strtol(optarg, NULL, 0); break;
+        case 'c': opt.chunk = strtoul(optarg, NULL, 0); break;
+        case 'd': opt.drop = strtod(optarg, NULL); break;
+        case 'f': opt.flip = strtod(optarg, NULL); break;
+        case 't': opt.trunc = strtod(optarg, NULL); break;
+        case 's': opt.seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'p': opt.policy = parse_policy(optarg); break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (opt.chunk == 0 || opt.chunk > CHUNK_MAX)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    rng_state = opt.seed ? opt.seed : 1;
+
+    int in_fd = -1;
+    if (opt.input)
+    {
+        in_fd = open(opt.input, O_RDONLY | O_NOCTTY);
+        if (in_fd < 0)
+        {
+            fprintf(stderr, "Cannot open %s: %s\n", opt.input, strerror(errno));
+            return 1;
+        }
+        setup_tty(in_fd);
+    }
+    // A tty/pty already delivers at line rate, only a capture file is paced
+    // tty/pty本身即按线路速率到达, 只有捕获文件需要限速
+    struct stat in_stat;
+    bool paced = opt.baud > 0 && (in_fd < 0 || (fstat(in_fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode)));
+    FILE* out = NULL;
+    if (opt.output)
+    {
+        out = fopen(opt.output, "wb");
+        if (out == NULL)
+        {
+            fprintf(stderr, "Cannot open %s: %s\n", opt.output, strerror(errno));
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    uart_frame_decoder_init(&decoder, frame_handler, NULL);
+    sample_ring_init(&ring, opt.policy);
+
+    uint8_t buf[CHUNK_MAX];
+    double start = now_seconds();
+    while (!stop_requested)
+    {
+        ssize_t n;
+        if (in_fd >= 0)
+        {
+            n = read(in_fd, buf, opt.chunk);
+            if (n < 0 && errno == EINTR)
+                continue;
+        }
+        else
+            n = (ssize_t)generate_read(buf, opt.chunk);
+        if (n <= 0)
+            break;
+        report.bytes_in += n;
+
+        size_t len = inject_faults(buf, (size_t)n);
+        if (out && len > 0)
+            fwrite(buf, 1, len, out);
+
+        double t0 = now_seconds();
+        chunk_base = report.bytes_fed;
+        uart_frame_decoder_feed(&decoder, buf, len);
+        report.bytes_fed += len;
+
+        while (consume_sample())
+            ;
+        report.decode_seconds += now_seconds() - t0;
+
+        // Pace to the line rate: 10 bits per byte for 8N1
+        // 按线路速率限速: 8N1每字节10位
+        if (paced)
+        {
+            double due = start + report.bytes_in * 10.0 / opt.baud;
+            double wait = due - now_seconds();
+            if (wait > 0)
+            {
+                struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    double wall = now_seconds() - start;
+
+    if (out)
+        fclose(out);
+    if (in_fd >= 0)
+        close(in_fd);
+
+    print_report(wall);
+    return report.mismatched ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+/*
+    uart_replay msg_framer_test.c
+    Host test of the client message framer: JSON objects with and without
+    delimiters, binary commands, junk in front of a message, and oversized
+    JSON and binary messages followed directly by a valid one.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "msg_framer.h"
+
+static unsigned failures = 0;
+
+// Count a failed check and carry on, so one run reports every failure
+// 记录失败的检查并继续, 一次运行即可报告所有失败
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// Every message dispatched, joined with '|' and binary messages shown as "BIN<len>"
+// 所有已分发的消息, 以'|'连接, 二进制消息记作"BIN<长度>"
+static char got[4096];
+
+static void record(const char* msg, size_t len, void* ctx)
+{
+    (void)ctx;
+    size_t used = strlen(got);
+    if ((uint8_t)msg[0] == MSG_BIN_MAGIC)
+        snprintf(got + used, sizeof(got) - used, "%sBIN%u", used ? "|" : "", (unsigned)len);
+    else
+        snprintf(got + used, sizeof(got) - used, "%s%.*s", used ? "|" : "", (int)len, msg);
+}
+
+/**
+ * @brief Feed a stream to a fresh framer in chunks of a given size
+ * @param data Stream
+ * @param len Stream length
+ * @param chunk Bytes per msg_framer_commit call
+ * @param dropped Messages the framer dropped
+ * @retval None, the messages are in got
+ */
+static void run(const uint8_t* data, size_t len, size_t chunk, unsigned* dropped)
+{
+    static MsgFramer_t f;
+    msg_framer_init(&f);
+    got[0] = '\0';
+    for (size_t pos = 0;pos < len;)
+    {
+        size_t space;
+        char* dst = msg_framer_buffer(&f, &space);
+        size_t n = len - pos;
+        if (n > chunk)
+            n = chunk;
+        if (n > space)
+            n = space;
+        memcpy(dst, data + pos, n);
+        msg_framer_commit(&f, n, record, NULL);
+        pos += n;
+    }
+    *dropped = f.dropped;
+}
+
+/**
+ * @brief Check a stream in every chunk size from 1 to 64 bytes and all at once
+ * @param data Stream
+ * @param len Stream length
+ * @param expect Messages expected, as recorded in got
+ * @param expect_dropped Messages expected to be dropped
+ * @retval None
+ */
+static void check_stream(const uint8_t* data, size_t len, const char* expect, unsigned expect_dropped)
+{
+    for (size_t chunk = 1;chunk <= 65;chunk++)
+    {
+        unsigned dropped;
+        run(data, len, chunk == 65 ? len : chunk, &dropped);
+        if (strcmp(got, expect) != 0 || dropped != expect_dropped)
+        {
+            fprintf(stderr, "chunk %u: got \"%s\" dropped %u, expected \"%s\" dropped %u\n",
+                (unsigned)chunk, got, dropped, expect, expect_dropped);
+            failures++;
+            return;
+        }
+    }
+}
+
+typedef struct
+{
+    uint8_t data[2048];
+    size_t len;
+} Stream_t;
+
+static void put(Stream_t* s, const void* data, size_t len)
+{
+    memcpy(s->data + s->len, data, len);
+    s->len += len;
+}
+
+static void put_str(Stream_t* s, const char* str)
+{
+    put(s, str, strlen(str));
+}
+
+static void put_bin(Stream_t* s, uint8_t payload_len)
+{
+    uint8_t header[MSG_BIN_HEADER_LEN] = { MSG_BIN_MAGIC, payload_len, 1, 0, 0, 0 };
+    put(s, header, sizeof(header));
+    for (uint8_t i = 0;i < payload_len;i++)
+        s->data[s->len++] = '{';
+}
+
+/**
+ * @brief Append a JSON object longer than the reassembly buffer, with nesting,
+ *        braces inside strings and escaped quotes
+ * @param s Stream
+ * @retval None
+ */
+static void put_oversized(Stream_t* s)
+{
+    put_str(s, "{\"pad\":[");
+    while (s->len < CONFIG_CLIENT_RX_BUFFER_SIZE + 100)
+        put_str(s, "{\"s\":\"}]\\\"{\"},");
+    put_str(s, "{}]}");
+}
+
+int main(void)
+{
+    Stream_t s;
+
+    // Delimited and back to back objects
+    // 带分隔符与首尾相接的对象
+    s.len = 0;
+    put_str(&s, "{\"a\":1}\n{\"b\":\"}\"}{\"c\":[{}]}\r\n");
+    check_stream(s.data, s.len, "{\"a\":1}|{\"b\":\"}\"}|{\"c\":[{}]}", 0);
+
+    // Binary commands mixed with JSON
+    // 二进制命令与JSON混合
+    s.len = 0;
+    put_bin(&s, 4);
+    put_str(&s, "{\"a\":1}");
+    put_bin(&s, 0);
+    check_stream(s.data, s.len, "BIN10|{\"a\":1}|BIN6", 0);
+
+    // Junk right in front of a binary command, no newline
+    // 二进制命令前紧跟无效字节, 无换行
+    s.len = 0;
+    put_str(&s, "junk");
+    put_bin(&s, 4);
+    put_str(&s, "x{\"a\":1}");
+    check_stream(s.data, s.len, "BIN10|{\"a\":1}", 2);
+
+    // An oversized object followed directly by a valid object and a binary command
+    // 超长对象之后直接跟随有效对象与二进制命令
+    s.len = 0;
+    put_oversized(&s);
+    put_str(&s, "{\"a\":1}");
+    put_bin(&s, 4);
+    put_str(&s, "{\"b\":2}");
+    check_stream(s.data, s.len, "{\"a\":1}|BIN10|{\"b\":2}", 1);
+
+    // A binary command too long for the buffer is dropped whole
+    // 超出缓冲区的二进制命令整条丢弃
+    s.len = 0;
+    put_bin(&s, 255);
+    put_str(&s, "{\"a\":1}");
+    check_stream(s.data, s.len, MSG_BIN_HEADER_LEN + 255 > CONFIG_CLIENT_RX_BUFFER_SIZE ? "{\"a\":1}" : "BIN261|{\"a\":1}",
+        MSG_BIN_HEADER_LEN + 255 > CONFIG_CLIENT_RX_BUFFER_SIZE ? 1 : 0);
+
+    if (failures)
+    {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("message framer: all checks passed\n");
+    return 0;
+}